@@ -7,29 +7,101 @@
 #ifndef _LUTZE_GC
 #define _LUTZE_GC
 
+#include <csetjmp>
 #include <set>
 #include <string>
+#include <vector>
+#include <boost/atomic.hpp>
 #include <boost/cstdint.hpp>
 #include <boost/type_traits.hpp>
 #include <boost/utility/enable_if.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/tss.hpp>
 #include <boost/preprocessor/punctuation.hpp>
 #include <boost/preprocessor/repetition.hpp>
 #include <boost/preprocessor/arithmetic.hpp>
 #include "gc_ptr.h"
+#include "gc_allocator.h"
+#include "gc_page_map.h"
+#include "gc_page_tracker.h"
+
+#if defined(_WIN32) || defined(_WIN64) || defined(BOOST_THREAD_WIN32)
+#define GC_PLATFORM_WINDOWS
+#endif
+#if defined(__SVR4) && defined(__sun) || defined(BOOST_THREAD_SOLARIS)
+#define GC_PLATFORM_SOLARIS
+#endif
+#if defined(__sparc__) || defined(__sparc)
+#define GC_PLATFORM_SPARC
+#endif
+#if defined(__ppc__) || defined(__powerpc__) || (__ppc64__) || (__powerpc64__)
+#define GC_PLATFORM_POWERPC
+#endif
+#if defined(_MAC) || defined(BOOST_THREAD_MACOS)
+#define GC_PLATFORM_MAC
+#endif
+#if defined(LINUX) || defined(BOOST_THREAD_LINUX)
+#define GC_PLATFORM_LINUX
+#endif
 
 namespace lutze
 {
     class gc;
 
+    template <class T>
+    class gc_array;
+
     // all garbage collected classes must be derived from this base class
     class gc_object
     {
     public:
+        gc_object()
+        {
+            reset_header();
+        }
+
+        // copies are registered separately, so never share collector state
+        gc_object(const gc_object& rhs)
+        {
+            reset_header();
+        }
+
+        gc_object& operator = (const gc_object& rhs)
+        {
+            return *this;
+        }
+
         virtual ~gc_object()
         {
+            delete header.history_overflow;
+        }
+
+        // objects are allocated from size-segregated slabs of the allocating
+        // thread, and freed back to their slab from any thread
+        static void* operator new(size_t size)
+        {
+            return detail::allocate_object(size);
+        }
+
+        static void operator delete(void* ptr, size_t size)
+        {
+            detail::free_object(ptr, size);
+        }
+
+        // objects allocated by new_gc are placed in the slabs of their space
+        static void* operator new(size_t size, const detail::object_space& space)
+        {
+            BOOST_ASSERT(size <= space.size);
+            return detail::allocate_object(space.size, space.space);
+        }
+
+        static void operator delete(void* ptr, const detail::object_space& space)
+        {
+            detail::free_object(ptr, space.size);
         }
 
     protected:
@@ -38,7 +110,80 @@ namespace lutze
             // override
         }
 
+        // return true if every object marked by mark_members is referenced
+        // from within this object itself (rather than from separately
+        // allocated storage such as a container), so that an object on an
+        // unwritten page can be assumed to reference the same objects
+        virtual bool inline_members() const
+        {
+            return false;
+        }
+
+    private:
+        // collector bookkeeping kept inside the object, so moving it between
+        // gcs only moves a pointer (mark words are kept in the owner registry);
+        // the owner is atomic, as the write barrier reads it on the mutator
+        // thread while a concurrent mark takes ownership of transferred objects
+        struct gc_header
+        {
+            boost::atomic<gc*> owner; // gc holding the object, NULL while in transit between gcs
+            uint64_t history; // ids of gcs already visited, below 64
+            std::vector<uint64_t>* history_overflow; // ids from 64, allocated when needed
+            uint32_t index; // owner registry record, zero while queued for release
+            uint32_t offset; // distance from the start of the allocation
+            uint32_t size; // allocation size in bytes
+            bool young; // in the owner nursery, registered since its last collection
+            bool trivial; // freed without running its destructor once released
+            bool leaf; // holds no managed pointers, so is never traced
+            bool element; // unregistered element of a managed array offset bytes above the array
+        };
+
+        void reset_header()
+        {
+            header.owner.store(NULL, boost::memory_order_relaxed);
+            header.history = 0;
+            header.history_overflow = NULL;
+            header.index = 0;
+            header.offset = 0;
+            header.size = 0;
+            header.young = false;
+            header.trivial = false;
+            header.leaf = false;
+            header.element = false;
+        }
+
+        // an element of a managed array is marked, shaded and unmarked
+        // through the array holding it
+        const gc_object* registered_object() const
+        {
+            return header.element ? (const gc_object*)((const uint8_t*)this - header.offset) : this;
+        }
+
+        mutable gc_header header;
+
         friend class gc;
+
+        template <class T>
+        friend class gc_array;
+    };
+
+    // specialize as boost::true_type for classes whose destructor, and those
+    // of their members and bases other than gc_object, does nothing (such as
+    // classes holding only PODs and gc_ptr members); new_gc allocates them on
+    // separate slabs, and they are freed without running their destructor
+    template <class T>
+    struct gc_trivially_destructible : public boost::false_type
+    {
+    };
+
+    // specialize as boost::true_type for leaf classes that reference no
+    // managed objects, neither through members nor through storage they own
+    // (such as text, byte buffers and numeric arrays); new_gc allocates them
+    // in a pointer-free space of slabs, and they are marked without ever
+    // calling mark_members
+    template <class T>
+    struct gc_pointer_free : public boost::false_type
+    {
     };
 
     // all garbage collected container classes must be derived from this class
@@ -51,24 +196,92 @@ namespace lutze
         }
     };
 
+    // collection statistics accumulated by a gc instance
+    struct gc_stats
+    {
+        gc_stats() : collections(0), scan_candidates(0), scan_lookups(0), scan_filtered(0),
+            scan_bytes(0), scan_bytes_skipped(0), last_scan_bytes(0), last_scan_bytes_skipped(0),
+            objects_traced(0), objects_unchanged(0), mark_slices(0), objects_shaded(0), objects_deferred(0),
+            minor_collections(0), objects_promoted(0), stores_remembered(0), objects_destroyed(0), sweep_steps(0),
+            objects_finalized(0), objects_reclaimed(0), heap_bytes_reserved(0), heap_bytes_committed(0), heap_bytes_released(0)
+        {
+        }
+
+        uint64_t collections; // number of collections performed
+        uint64_t scan_candidates; // stack locations considered as possible roots
+        uint64_t scan_lookups; // object registry lookups performed for candidates
+        uint64_t scan_filtered; // lookups saved by heap bounds and membership filter
+        uint64_t scan_bytes; // stack bytes scanned for candidates
+        uint64_t scan_bytes_skipped; // stack bytes unchanged since the previous scan
+        uint64_t last_scan_bytes; // stack bytes scanned by the most recent collection
+        uint64_t last_scan_bytes_skipped; // stack bytes skipped by the most recent collection
+        uint64_t objects_traced; // objects whose members were marked
+        uint64_t objects_unchanged; // objects on unwritten pages assumed to be still reachable
+        uint64_t mark_slices; // incremental mark slices performed
+        uint64_t objects_shaded; // objects queued by the write barrier while marking incrementally or concurrently
+        uint64_t objects_deferred; // objects registered once a concurrent mark had finished
+        uint64_t minor_collections; // collections of the nursery alone
+        uint64_t objects_promoted; // nursery objects surviving a minor collection
+        uint64_t stores_remembered; // young objects stored outside the stack, recorded by the write barrier
+        uint64_t objects_destroyed; // released objects destroyed by this gc instance
+        uint64_t sweep_steps; // calls to collect that destroyed objects queued by an earlier collection
+        uint64_t objects_finalized; // released objects passed to the finalizer threads to destroy
+        uint64_t objects_reclaimed; // released trivially destructible objects freed without a destructor
+
+        // memory of the slab heap of this gc's thread once the objects
+        // released by the last collection were destroyed: address space
+        // mapped, bytes held by slabs in use, and bytes of empty chunks
+        // returned to the operating system; heaps belong to threads rather
+        // than gcs, so this includes objects the thread allocated for other
+        // gcs, and slabs left by an exited thread whose heap it adopted
+        uint64_t heap_bytes_reserved;
+        uint64_t heap_bytes_committed;
+        uint64_t heap_bytes_released;
+    };
+
+    namespace detail
+    {
+        // run the destructor of a released object and free its allocation
+        void destroy_object(const gc_object* pobj);
+    }
+
     class gc
     {
+        #if defined(GC_PRECISE_ROOTS)
+        friend bool detail::is_stack_address(const void* ptr);
+        #endif
+        friend void detail::barrier_object(const void* slot, const gc_object* pobj);
+        friend void detail::destroy_object(const gc_object* pobj);
+
     public:
         gc(bool static_gc = false);
-        ~gc();
-
-        typedef std::set<gc*> gc_set;
 
     private:
-        struct gc_node
+        typedef detail::page_map::record gc_record;
+
+        // registry record flags
+        static const uint32_t record_inline = 1; // object has only inline members
+
+        typedef std::vector<const gc_object*> object_list;
+        typedef std::pair<const uint8_t*, const uint8_t*> stack_region;
+        typedef std::vector<stack_region> region_list;
+
+        // young object and the address it was stored at
+        typedef std::pair<const void*, const gc_object*> object_store;
+        typedef std::vector<object_store> store_list;
+
+        // bounds of a registered stack or frame, with the stack pointer and
+        // registers saved when it was last suspended
+        struct stack_extent
         {
-            gc_node(const gc_object* obj = NULL) : mark_token(0), object(obj) {}
-            const gc_object* object;
-            uint32_t mark_token;
-            gc_set history;
+            const uint8_t* first;
+            const uint8_t* last;
+            const uint8_t* suspended;
+            jmp_buf registers;
         };
 
-        typedef boost::unordered_map<const void*, gc_node> node_map;
+        // keyed by base address, so switching to a stack finds it directly
+        typedef boost::unordered_map<const uint8_t*, stack_extent> extent_map;
 
         struct scoped_lock_if
         {
@@ -86,21 +299,158 @@ namespace lutze
             bool lock_cond;
         };
 
-        node_map object_registry;
-        node_map unmark_objects;
-        node_map release_queue;
+        // compact bitset of registered object addresses, used to reject
+        // stack candidates before probing the object registry
+        struct root_filter
+        {
+            root_filter() : mask(0)
+            {
+            }
+
+            inline static uint64_t hash(const void* ptr)
+            {
+                return ((uint64_t)(uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+            }
+
+            inline void insert(const void* ptr)
+            {
+                if (mask == 0)
+                    return;
+                uint64_t bit = (hash(ptr) >> 32) & mask;
+                bits[(size_t)(bit >> 6)] |= (uint64_t)1 << (bit & 63);
+            }
+
+            inline bool contains(const void* ptr) const
+            {
+                if (mask == 0)
+                    return true;
+                uint64_t bit = (hash(ptr) >> 32) & mask;
+                return (bits[(size_t)(bit >> 6)] & ((uint64_t)1 << (bit & 63))) != 0;
+            }
+
+            std::vector<uint64_t> bits;
+            uint64_t mask;
+        };
+
+        detail::page_map object_registry;
+        object_list release_queue;
+
+        // objects found to be unreachable by every gc (including those found
+        // by the static gc when collected after this one), destroyed a share
+        // at a time by later calls to collect rather than by the collection
+        object_list sweep_queue;
+        size_t sweep_quota;
+        object_list destroy_list; // objects to destroy once the registry lock is released
+
+        // scratch buffers retained across collections, so that a collection
+        // does not allocate in steady state
+        object_list roots;
+        object_list unmark_objects;
+        object_list mark_stack; // objects waiting for their members to be marked
+        object_list adopt_objects; // transferred objects found by a parallel mark
+        bool parallel_marking;
+
+        std::vector<uint32_t> unmarked_records;
+        std::vector<object_list> transfer_lists; // indexed by target gc id
 
         boost::mutex static_mutex;
         boost::mutex transfer_mutex;
-        node_map transfer_queue;
+        object_list transfer_queue;
 
+        // ids reused by a new gc since the transfer queue was last taken
+        // (guarded by transfer_mutex), whose bits in the history of released
+        // objects now held were left by the gc that had the id before
+        std::vector<uint32_t> recycled_ids;
+
+        // running gc instances indexed by id (NULL for free ids), and a bitset
+        // of the ids in use
         static boost::mutex gc_registry_mutex;
-        static gc_set gc_registry;
+        static std::vector<gc*> gc_registry;
+        static std::vector<uint64_t> gc_running;
 
         bool static_gc;
+        uint32_t gc_id;
         uint32_t mark_token;
         uint32_t register_count;
 
+        // registered address range and filter used to prefilter stack roots
+        uintptr_t heap_min;
+        uintptr_t heap_max;
+        root_filter filter;
+        uint32_t filter_stale;
+
+        // source of written pages, the collections remaining before the next
+        // full trace and whether the current collection traces only changes
+        page_tracker* tracker;
+        uint32_t full_trace_countdown;
+        bool partial_trace;
+
+        // whether an incremental mark is in progress, the time allowed for
+        // each slice performed by collect (zero to collect in one pause) and
+        // objects queued by the write barrier of any thread while shading
+        bool incremental_marking;
+        uint32_t slice_budget;
+        boost::mutex shade_mutex;
+        object_list shaded_objects;
+        boost::atomic<bool> shading;
+
+        // whether new objects enter a nursery collected on its own, the
+        // objects registered since it was last collected, and the stores of
+        // young objects recorded by the write barrier of any thread (guarded
+        // by shade_mutex), which include every old object referencing one
+        bool generational;
+        object_list nursery;
+        store_list remembered_stores;
+        store_list taken_stores;
+        bool minor_marking;
+
+        // objects promoted since the last full collection, and the objects
+        // it retained
+        size_t promoted_count;
+        size_t retained_count;
+
+        // completion state shared between a concurrent mark and its handles
+        struct async_state;
+
+        // whether a concurrent mark is in progress on the background thread,
+        // which owns the registry until it finishes, and objects allocated
+        // meanwhile that are registered once it has
+        bool async_marking;
+        boost::thread async_thread;
+        boost::shared_ptr<async_state> async_status;
+        object_list pending_objects;
+
+        // thread stack top, queried once on first collection
+        uintptr_t cached_stack_top;
+
+        // candidate stack words collected during root scanning
+        std::vector<uintptr_t> candidates;
+
+        // alternate stacks and frames registered with this gc, the active
+        // stack (or NULL when running on the thread stack) and the thread
+        // stack state saved while an alternate stack is active
+        extent_map stack_extents;
+        stack_extent* active_stack;
+        stack_extent thread_stack;
+
+        // stack regions excluded from root scanning, in order of registration,
+        // and the clipped and merged exclusions used by the current scan
+        region_list no_scan_regions;
+        region_list scan_exclusions;
+        bool no_scan_changed;
+
+        #if defined(GC_INCREMENTAL_STACK_SCAN)
+        // copy of each stack chunk and the candidates it yielded, counted down
+        // from the stack top, along with the address range used to build them
+        std::vector<uint8_t> stack_shadow;
+        std::vector< std::vector<uintptr_t> > stack_summary;
+        const uint8_t* summary_top;
+        uintptr_t summary_min;
+        uintptr_t summary_max;
+        #endif
+
+        gc_stats statistics;
+
     public:
         // return current lutze gc version
         static std::string gc_version();
@@ -124,18 +474,111 @@ namespace lutze
         static gc& get_static_gc();
 
         // register new object in this gc instance
-        inline void register_object(const gc_object* pobj)
+        template <class T>
+        inline void register_object(const T* pobj)
+        {
+            register_object(pobj, sizeof(T));
+        }
+
+        // register new object occupying size bytes, including any storage
+        // allocated inline after it
+        template <class T>
+        inline void register_object(const T* pobj, size_t size)
+        {
+            static_cast<const gc_object*>(pobj)->header.trivial = gc_trivially_destructible<T>::value;
+            static_cast<const gc_object*>(pobj)->header.leaf = gc_pointer_free<T>::value;
+            register_object(static_cast<const gc_object*>(pobj), pobj, size);
+        }
+
+        // register new object allocated at start and occupying size bytes
+        inline void register_object(const gc_object* pobj, const void* start, size_t size)
         {
             scoped_lock_if lock(static_mutex, static_gc);
             ++register_count;
-            object_registry.insert(std::make_pair(normalize_ptr(pobj), gc_node(pobj)));
+            pobj->header.offset = (uint32_t)((const uint8_t*)pobj - (const uint8_t*)start);
+            pobj->header.size = (uint32_t)size;
+
+            // objects allocated while marking concurrently are live, and are
+            // left without an owner until the registry is available
+            if (async_marking && !finish_async(false))
+            {
+                pending_objects.push_back(pobj);
+                return;
+            }
+            insert_object(pobj, (uintptr_t)start);
+            if (generational)
+            {
+                pobj->header.young = true;
+                nursery.push_back(pobj);
+            }
+
+            // objects allocated while marking incrementally are traced before
+            // the mark completes, since their members are not shaded
+            if (incremental_marking)
+                mark_stack.push_back(pobj);
         }
 
-        // unregister destroyed object from this gc instance
+        // unregister released object from this gc instance
         inline void unregister_object(const gc_object* pobj)
         {
             scoped_lock_if lock(static_mutex, static_gc);
-            object_registry.erase(normalize_ptr(pobj));
+            if (pobj->header.owner.load(boost::memory_order_relaxed) != this || pobj->header.index == 0)
+                return;
+            const gc_object* moved = object_registry.erase(pobj->header.index);
+            if (moved != NULL)
+                moved->header.index = pobj->header.index;
+            pobj->header.index = 0;
+
+            ++filter_stale;
+        }
+
+        // exclude a stack address range (such as a large scratch buffer) from
+        // root scanning by the current thread's gc for the lifetime of the guard
+        class no_scan_region
+        {
+        public:
+            no_scan_region(const void* ptr, size_t size) : owner(get_gc()), first((const uint8_t*)ptr), last((const uint8_t*)ptr + size)
+            {
+                owner.push_no_scan_region(first, last);
+            }
+
+            ~no_scan_region()
+            {
+                owner.pop_no_scan_region(first, last);
+            }
+
+        private:
+            no_scan_region(const no_scan_region&);
+            no_scan_region& operator = (const no_scan_region&);
+
+            gc& owner;
+            const uint8_t* first;
+            const uint8_t* last;
+        };
+
+        // return cached thread stack top address
+        uintptr_t stack_top();
+
+        // register an alternate stack (such as a fiber stack) or heap-allocated
+        // frame (such as a coroutine frame) to be scanned for roots
+        void register_stack(const void* ptr, size_t size);
+
+        // unregister an alternate stack or frame before it is released
+        void unregister_stack(const void* ptr);
+
+        // notify gc that the current thread is about to switch to the given
+        // registered stack, or back to the thread stack if ptr is NULL
+        void switch_stack(const void* ptr);
+
+        // retrace only objects on pages written since the previous collection,
+        // using the given tracker (or NULL to always trace every object); the
+        // next collection after setting a tracker is a full trace
+        void set_page_tracker(page_tracker* tracker);
+
+        // return collection statistics for this gc instance
+        const gc_stats& stats() const
+        {
+            return statistics;
         }
 
         // a default mark function called for pod types
@@ -168,7 +611,7 @@ namespace lutze
         // mark container as unreachable
         void unmark(const gc_container& obj)
         {
-            mark_object(obj.get());
+            unmark_object(obj.get());
         }
 
         // mark object pointer as unreachable (used to force out of scope)
@@ -178,38 +621,351 @@ namespace lutze
             unmark_object(static_cast<gc_object*>(obj.get()));
         }
 
-        // check threshold before performing collection
+        // return true while stored and removed objects must be passed to the
+        // write barrier
+        static bool write_barrier_active()
+        {
+            return detail::write_barrier_users.load(boost::memory_order_relaxed) != 0;
+        }
+
+        // return true while any gc may be marking, when a change to the storage
+        // of a container must hold its lock; the count is only released once
+        // a concurrent mark has finished tracing
+        static bool container_lock_active()
+        {
+            return detail::write_barrier_users.load(boost::memory_order_acquire) != 0;
+        }
+
+        // a default write barrier called for pod types
+        template <class OBJ>
+        static void write_barrier(const OBJ& obj, typename boost::disable_if< boost::is_convertible<OBJ, gc_container> >::type* dummy = 0)
+        {
+            // do nothing
+        }
+
+        // shade container removed while an incremental mark is in progress
+        static void write_barrier(const gc_container& obj)
+        {
+            detail::write_barrier(obj.get());
+        }
+
+        // shade object pointer removed while an incremental mark is in progress
+        template <class OBJ>
+        static void write_barrier(const gc_ptr<OBJ>& obj)
+        {
+            detail::write_barrier(obj.get());
+        }
+
+        // shade both members of a removed pair (such as a map entry)
+        template <class FIRST, class SECOND>
+        static void write_barrier(const std::pair<FIRST, SECOND>& obj)
+        {
+            write_barrier(obj.first);
+            write_barrier(obj.second);
+        }
+
+        // shade every value in a range removed while an incremental mark is
+        // in progress
+        template <class ITER>
+        static void write_barrier_range(ITER first, ITER last)
+        {
+            if (!write_barrier_active())
+                return;
+            for (; first != last; ++first)
+                write_barrier(*first);
+        }
+
+        // a default write barrier called for pod types stored in holder
+        template <class OBJ>
+        static void write_barrier(const void* holder, const OBJ& obj, typename boost::disable_if< boost::is_convertible<OBJ, gc_container> >::type* dummy = 0)
+        {
+            // do nothing
+        }
+
+        // pass container stored in holder (the object or storage now
+        // referencing it) to the write barrier
+        static void write_barrier(const void* holder, const gc_container& obj)
+        {
+            detail::write_barrier(holder, obj.get());
+        }
+
+        // pass object pointer stored in holder to the write barrier
+        template <class OBJ>
+        static void write_barrier(const void* holder, const gc_ptr<OBJ>& obj)
+        {
+            detail::write_barrier(holder, obj.get());
+        }
+
+        // pass both members of a pair stored in holder to the write barrier
+        template <class FIRST, class SECOND>
+        static void write_barrier(const void* holder, const std::pair<FIRST, SECOND>& obj)
+        {
+            write_barrier(holder, obj.first);
+            write_barrier(holder, obj.second);
+        }
+
+        // pass every value in a range stored in holder to the write barrier
+        template <class ITER>
+        static void write_barrier_range(const void* holder, ITER first, ITER last)
+        {
+            if (!write_barrier_active())
+                return;
+            for (; first != last; ++first)
+                write_barrier(holder, *first);
+        }
+
+        // set the number of helper threads shared by all gc instances to mark
+        // large object graphs in parallel with the collecting thread (zero,
+        // the default, marks on the collecting thread only)
+        static void set_mark_threads(uint32_t helpers);
+
+        // set the number of threads shared by all gc instances that run the
+        // destructors of released objects, so collections only hand them
+        // over (zero, the default, destroys them on the collecting thread,
+        // lazily when collecting from new_gc); existing threads finish
+        // destroying the objects already handed to them first
+        static void set_finalizer_threads(uint32_t threads);
+
+        // block until the finalizer threads have destroyed every object
+        // handed to them
+        static void flush_finalizers();
+
+        // check threshold before performing collection (a forced collection
+        // first completes any incremental collection in progress)
         void collect(bool force = false);
 
+        // mark for at most budget_us microseconds, first starting an
+        // incremental collection if none is in progress and the threshold
+        // has been reached (or force is set), and complete the collection
+        // once no objects remain to be marked; returns true while the
+        // incremental collection is still in progress
+        bool collect_slice(uint32_t budget_us, bool force = false);
+
+        // collect incrementally from collect (and therefore new_gc), marking
+        // for at most budget_us microseconds per call, or zero (the default)
+        // to perform each collection in a single pause
+        void set_slice_budget(uint32_t budget_us);
+
+        // handle to a collection marking on a background thread, which can
+        // be polled or waited on from any thread
+        class collect_handle
+        {
+        public:
+            collect_handle();
+
+            // return true once marking, sweeping and disposal have finished
+            bool done() const;
+
+            // block until the collection has finished
+            void wait() const;
+
+        private:
+            explicit collect_handle(const boost::shared_ptr<async_state>& status);
+
+            boost::shared_ptr<async_state> status;
+
+            friend class gc;
+        };
+
+        // snapshot roots on this thread, then mark, sweep and dispose on a
+        // background thread while this thread keeps running (completes any
+        // incremental collection in progress instead); objects allocated
+        // meanwhile are registered by the first call to new_gc or collect
+        // after the collection has finished
+        collect_handle collect_async();
+
+        // register new objects in a nursery, collected on its own by collect
+        // (and therefore new_gc) until the objects promoted from it exceed
+        // those retained by the last full collection; young objects stored
+        // in old objects are found through the write barrier of gc_ptr and
+        // the gc containers, so a young object copied into other storage
+        // owned by an old object must be passed to write_barrier with it
+        void set_generational(bool enabled);
+
+        // collect the nursery alone, tracing only young objects reachable
+        // from the roots or stored since the previous collection, and
+        // promoting those that survive
+        void collect_nursery();
+
+        // destroy every object still queued by lazy sweeping, which
+        // otherwise happens a share at a time on each call to collect (and
+        // therefore new_gc) before the next collection
+        void finish_sweep();
+
         // perform final collection when gc instance terminates
         void final_collect();
 
     private:
-        // normalize given pointer to compensate for alignment
-        inline void* normalize_ptr(const gc_object* pobj)
+        // record object allocated at start in the registry
+        inline void insert_object(const gc_object* pobj, uintptr_t start)
         {
-            return (void*)((uintptr_t)pobj & ~0xf);
+            gc_object::gc_header& header = pobj->header;
+            header.owner.store(this, boost::memory_order_relaxed);
+            header.index = object_registry.insert(pobj, (const void*)start, header.size);
+            if (pobj->inline_members())
+                object_registry[header.index].flags = record_inline;
+            track_object(start, header.size);
         }
 
-        void static_collect(bool force);
+        // include object address range and pages in root prefilter
+        inline void track_object(uintptr_t start, size_t size)
+        {
+            uintptr_t last = start + (size == 0 ? 0 : size - 1);
+            if ((start & ~(uintptr_t)0xf) < heap_min)
+                heap_min = start & ~(uintptr_t)0xf;
+            if (last > heap_max)
+                heap_max = last;
+            for (uintptr_t page = start >> detail::page_map::page_shift; page <= last >> detail::page_map::page_shift; ++page)
+                filter.insert((const void*)(page << detail::page_map::page_shift));
+        }
+
+        // return true if candidate address may lie within a registered object
+        inline bool maybe_object(const void* ptr) const
+        {
+            uintptr_t address = (uintptr_t)ptr;
+            return (address & ~(uintptr_t)0xf) >= heap_min && address <= heap_max &&
+                   filter.contains((const void*)(address >> detail::page_map::page_shift << detail::page_map::page_shift));
+        }
+
+        // rebuild root prefilter from current object registry
+        void rebuild_filter();
+
+        // collect the static gc after the collection of a thread gc, queueing
+        // objects to destroy on sweeper (the thread gc) when given
+        void static_collect(bool force, gc* sweeper = NULL);
 
         // retrieve current thread stack top address
-        uintptr_t stack_top() const;
+        static uintptr_t query_stack_top();
 
         // check thresholds and return true if collection should be performed
         bool check_threshold();
 
+        // return true if a full collection should be performed rather than
+        // a minor one
+        bool full_collection_due();
+
+        // treat every nursery object as old and forget remembered stores,
+        // before a full collection or when the nursery is disabled
+        void promote_nursery();
+
+        // return true if ptr lies on the thread stack of the current thread
+        static bool on_thread_stack(const void* ptr);
+
         // prepare mark token and transfer queue for collection
         void init_collect();
 
         // scan stack address space for object roots
-        void find_roots(node_map& roots);
+        void find_roots(object_list& roots);
+
+        // append candidate words between first and last, skipping excluded regions
+        void scan_stack_gaps(const uint8_t* first, const uint8_t* last, uintptr_t scan_min, uintptr_t scan_max, std::vector<uintptr_t>& found);
+
+        // append candidate words from a suspended stack or registered frame
+        void scan_suspended_stack(const stack_extent& extent);
+
+        // return registered stack with the given base address, or NULL
+        stack_extent* find_stack(const void* ptr);
+
+        // return top address of the stack the current thread is running on
+        uintptr_t active_stack_top();
+
+        // return true if the given stack range lies entirely within an excluded region
+        bool is_excluded(const uint8_t* first, const uint8_t* last) const;
+
+        // register and unregister a stack region excluded from root scanning
+        void push_no_scan_region(const uint8_t* first, const uint8_t* last);
+        void pop_no_scan_region(const uint8_t* first, const uint8_t* last);
+
+        // append candidate words found between first and last that lie within the given address range
+        void scan_stack_range(const uint8_t* first, const uint8_t* last, uintptr_t scan_min, uintptr_t scan_max, std::vector<uintptr_t>& found);
+
+        #if defined(GC_INCREMENTAL_STACK_SCAN)
+        // append candidate words, reusing those from stack chunks unchanged since the previous scan
+        void scan_stack_incremental(const uint8_t* first, const uint8_t* last);
+        #endif
+
+        // begin a partial trace if the page tracker allows it, adding objects
+        // on written pages to roots and flagging the others as unchanged
+        void find_changed_objects(object_list& roots);
+
+        // start a new page tracking interval once collection completes
+        void reset_page_tracker();
+
+        // recursively mark root objects, other than those explicitly unmarked
+
+        void mark_objects(const object_list& roots);
 
-        // recursively mark root objects
-        void mark_objects(const node_map& roots);
+        // queue given object pointer to be marked as reachable
+        inline void mark_object(const gc_object* pobj)
+        {
+            if (pobj == NULL)
+                return;
+            if (parallel_marking)
+                push_shared(pobj);
+            else
+                mark_stack.push_back(pobj);
+        }
+
+        // mark queued objects and the objects they reference until none
+        // remain, or until budget objects have been traced
+        void drain_mark_stack(size_t budget = ~(size_t)0);
+
+        // queue roots, other than those explicitly unmarked, on the mark stack
+        void queue_roots(const object_list& roots);
+
+        // start shading objects stored or removed by any thread
+        void begin_shading();
+
+        // mark objects queued by the write barrier until none remain, then
+        // stop shading
+        void drain_shaded_objects();
+
+        // queue roots and prepare the write barrier for an incremental mark
+        void begin_incremental();
+
+        // mark queued and shaded objects until the deadline passes, returning
+        // true if none remain
+        bool mark_slice(uint32_t budget_us);
+
+        // move objects queued by the write barrier onto the mark stack
+        void take_shaded_objects();
+
+        // mark objects reachable from the current roots, then sweep and
+        // dispose as for a single pause collection
+        void finish_incremental(bool force);
+
+        // discard an incremental mark in progress (when the gc terminates)
+        void abandon_incremental();
+
+        // mark, sweep and dispose on the background thread
+        void mark_async();
+
+        // register objects allocated during a concurrent mark once it has
+        // finished (waiting for it if wait is set), returning false if it
+        // is still in progress
+        bool finish_async(bool wait);
+
+        // queue object stored or removed while its owner is marking
+        // incrementally or concurrently, and remember the slot a young object
+        // was stored at
+        static void barrier(const void* slot, const gc_object* pobj);
+
+        // state shared by the workers of a parallel mark
+        struct parallel_mark;
 
-        // mark given object pointer as reachable
-        void mark_object(const gc_object* pobj);
+        // mark roots using the helper threads, returning false if they are
+        // unavailable
+        bool mark_parallel(const object_list& roots);
+
+        // mark objects as one worker of a parallel mark, stealing queued
+        // objects from the other workers until all are idle
+        void mark_worker(parallel_mark* state, uint32_t worker, uint32_t workers);
+
+        // mark given object as one worker of a parallel mark
+        void trace_shared(parallel_mark* state, const gc_object* pobj, uint64_t& traced);
+
+        // queue given object on the current worker's mark deque
+        void push_shared(const gc_object* pobj);
 
         // mark given object pointer as unreachable
         void unmark_object(const gc_object* pobj);
@@ -217,13 +973,56 @@ namespace lutze
         // sweep all unreachable objects to release queue
         void sweep_objects();
 
-        // clean up release queue by transferring ownership or destroying objects
-        void dispose_objects(bool destroy = false);
+        // clean up release queue by transferring ownership or destroying
+        // objects, or queueing them to be destroyed later by sweeper when given
+        void dispose_objects(bool destroy = false, gc* sweeper = NULL);
+
+        // destroy the next share of objects queued by lazy sweeping
+        void resume_sweep();
+
+        // free the memory of a trivially destructible object without running
+        // its destructor, returning false for other objects
+        static bool reclaim_object(const gc_object* pobj);
+
+        // run the destructor of an object and free its registered allocation
+        static void destroy_object(const gc_object* pobj);
+
+        // return empty slabs of the current thread's heap, releasing chunks
+        // that have stayed empty, and record the heap usage
+        void trim_heap();
+
+        // return the running gc an object should visit next, or NULL if it
+        // has visited them all (the static gc is visited last)
+        gc* next_gc(const gc_object* pobj) const;
+
+        // record in object history that this gc has been visited
+        void add_history(const gc_object* pobj) const;
+
+        // remove a gc id from object history
+        static void clear_history(const gc_object* pobj, uint32_t id);
+
+        // clear the bit of an id about to be reused from every object
+        // queued for transfer, and have each gc clear it from the released
+        // objects it holds (called with gc_registry_mutex held)
+        static void recycle_gc_id(uint32_t id);
 
         // called when transferring objects from other gc instances
-        void transfer(const node_map& transfer_nodes);
+        void transfer(const object_list& transfer_objects);
     };
 
+    // return the size and space of the slabs new_gc allocates T from, given
+    // the bytes of any storage allocated inline after the object
+    template <class T>
+    inline detail::object_space gc_object_space(size_t inline_size = 0)
+    {
+        uint32_t space = detail::heap_space_default;
+        if (gc_pointer_free<T>::value)
+            space = detail::heap_space_leaf;
+        else if (gc_trivially_destructible<T>::value)
+            space = detail::heap_space_trivial;
+        return detail::object_space(sizeof(T) + inline_size, space);
+    }
+
     // The following expands to...
     // template <class T, class A1, ... class A9>
     // gc_ptr<T> new_gc(const A1& a1, ... const A9& a9)
@@ -237,17 +1036,18 @@ namespace lutze
     gc_ptr<T> new_gc(BOOST_PP_ENUM_BINARY_PARAMS(N, const A, & a)) \
     { \
         gc& gc = gc::get_gc(); \
-        T* pobj = new T(BOOST_PP_ENUM_PARAMS(N, a)); \
-        gc.register_object(static_cast<gc_object*>(pobj)); \
+        T* pobj = new (gc_object_space<T>()) T(BOOST_PP_ENUM_PARAMS(N, a)); \
+        gc.register_object(pobj); \
+        gc_ptr<T> ptr(pobj); /* a root while collecting, even with precise roots */ \
         gc.collect(); \
-        return gc_ptr<T>(pobj); \
+        return ptr; \
     } \
     template<class T BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_PARAMS(N, class A)> \
     gc_ptr<T> new_static_gc(BOOST_PP_ENUM_BINARY_PARAMS(N, const A, & a)) \
     { \
         gc& gc = gc::get_static_gc(); \
-        T* pobj = new T(BOOST_PP_ENUM_PARAMS(N, a)); \
-        gc.register_object(static_cast<gc_object*>(pobj)); \
+        T* pobj = new (gc_object_space<T>()) T(BOOST_PP_ENUM_PARAMS(N, a)); \
+        gc.register_object(pobj); \
         return gc_ptr<T>(pobj); \
     }
     BOOST_PP_REPEAT_2ND(BOOST_PP_INC(9), NEW_GC, _)
@@ -0,0 +1,183 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_ALLOCATOR
+#define _LUTZE_GC_ALLOCATOR
+
+#include <cstddef>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace lutze
+{
+    namespace detail
+    {
+        class thread_heap;
+        struct heap_chunk;
+
+        // bytes of address space mapped for the slabs of a heap, bytes held
+        // by slabs in use, and bytes of empty chunks returned to the
+        // operating system (which are mapped, but not resident)
+        struct heap_usage
+        {
+            heap_usage() : reserved(0), committed(0), released(0)
+            {
+            }
+
+            uint64_t reserved;
+            uint64_t committed;
+            uint64_t released;
+        };
+
+        // spaces of separate slabs, so objects whose destructor is never run
+        // are kept apart from others
+        static const uint32_t heap_space_default = 0;
+        static const uint32_t heap_space_trivial = 1; // destructors elided
+        static const uint32_t heap_space_leaf = 2; // never traced, holding no pointers
+        static const uint32_t heap_spaces = 3;
+
+        // size and space of an object allocated by new_gc, passed to the
+        // placement operator new of gc_object (the size includes any storage
+        // allocated inline after the object)
+        struct object_space
+        {
+            object_space(size_t size, uint32_t space) : size(size), space(space)
+            {
+            }
+
+            size_t size;
+            uint32_t space;
+        };
+
+        // allocate memory for a managed object from the slabs of the given
+        // space of the current thread, or from the global heap if it is too
+        // large for a slab
+        void* allocate_object(size_t size, uint32_t space = heap_space_default);
+
+        // return memory of a destroyed object to the slab it came from, from
+        // any thread (size must match the allocation)
+        void free_object(void* ptr, size_t size);
+
+        // return the empty slabs of the current thread's heap to their chunks,
+        // releasing chunks that have stayed empty to the operating system,
+        // and return the usage of the heap
+        heap_usage trim_heap();
+
+        // aligned block of equally sized cells, carved from the start by
+        // bumping a pointer and then reused through a free list
+        struct slab
+        {
+            // size in bytes (a power of two) and alignment of every slab, so
+            // the slab of a cell is found by masking its address
+            static const size_t size = 64 * 1024;
+
+            thread_heap* heap; // heap owning the slab, never changes
+            heap_chunk* chunk; // chunk the slab was carved from
+            uint32_t size_class;
+            uint32_t cell_size;
+            uint32_t used; // cells allocated and not yet freed by the owner
+            bool listed; // current slab of its size class, or on the partial list
+            void* free_cells; // cells freed by the owner, linked through their first word
+            uint8_t* bump; // next cell never allocated
+            uint8_t* limit;
+            slab* next_partial;
+            boost::atomic<void*> remote_cells; // cells freed by other threads
+        };
+
+        // aligned region of address space mapped from the operating system
+        // and divided into slabs
+        struct heap_chunk
+        {
+            // size in bytes (a power of two) and alignment of every chunk
+            static const size_t size = 2 * 1024 * 1024;
+            static const uint32_t slabs = (uint32_t)(size / slab::size);
+
+            uint8_t* base;
+            size_t index; // position in the chunk list of its heap
+            uint32_t free_slabs; // bitset of slabs not in use
+            uint32_t empty_trims; // consecutive trims finding every slab free
+            bool released; // returned to the operating system while empty
+        };
+
+        // size-segregated slabs owned by one thread at a time, so allocation
+        // and freeing by the owner take no lock; heaps are never destroyed,
+        // but are released when their thread exits and adopted by the next
+        // thread to allocate
+        class thread_heap
+        {
+        public:
+            thread_heap();
+
+            // cell sizes are multiples of the granule up to the largest size
+            // held in slabs
+            static const size_t granule = 16;
+            static const size_t max_size = 1024;
+            static const size_t size_classes = max_size / granule + 1;
+
+            // allocate a cell of the given size class, numbered consecutively
+            // across the spaces (owner only)
+            void* allocate(uint32_t size_class);
+
+            // free a cell of a slab owned by this heap (owner only)
+            void free(slab* pslab, void* cell);
+
+            // free a cell of a slab owned by a heap belonging to another
+            // thread, or to no thread
+            static void free_remote(slab* pslab, void* cell);
+
+            // return empty slabs to their chunks, and release chunks that
+            // have been empty for several trims (owner only)
+            void trim();
+
+            // return the bytes reserved, committed and released
+            const heap_usage& usage() const;
+
+        private:
+            thread_heap(const thread_heap&);
+            thread_heap& operator = (const thread_heap&);
+
+            struct size_class_slabs
+            {
+                slab* current; // slab cells are allocated from
+                slab* partial; // other slabs with free cells
+            };
+
+            // replace the exhausted current slab of a size class and allocate
+            // from its replacement
+            void* refill(uint32_t size_class);
+
+            // move cells freed by other threads onto the free lists of their
+            // slabs
+            void collect_remote();
+
+            // allocate and initialize an empty slab, from the first chunk with
+            // a free slab or else from a newly mapped chunk
+            slab* new_slab(uint32_t size_class);
+
+            // return an empty slab to its chunk
+            void free_slab(slab* pslab);
+
+            size_class_slabs classes[size_classes * heap_spaces];
+
+            // chunks in order of mapping, and the index of the first that may
+            // have a free slab
+            std::vector<heap_chunk*> chunks;
+            size_t chunk_hint;
+            heap_usage bytes;
+
+            // slabs with cells freed by other threads since they were last
+            // collected, and whether there are any
+            boost::mutex remote_mutex;
+            std::vector<slab*> remote_slabs;
+            std::vector<slab*> taken_slabs;
+            boost::atomic<bool> remote_pending;
+        };
+    }
+}
+
+#endif
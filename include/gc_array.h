@@ -0,0 +1,172 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_ARRAY
+#define _LUTZE_GC_ARRAY
+
+#include <new>
+#include <boost/preprocessor/control/expr_if.hpp>
+#include "gc.h"
+
+namespace lutze
+{
+    // fixed number of objects allocated contiguously after the array and
+    // registered with it as a single object; elements are traced with the
+    // array, and a gc_ptr to any element keeps the whole array alive
+    template <class T>
+    class gc_array : public gc_object
+    {
+    public:
+        typedef T value_type;
+        typedef size_t size_type;
+        typedef T* iterator;
+        typedef const T* const_iterator;
+
+        virtual ~gc_array()
+        {
+            while (count != 0)
+                begin()[--count].~T();
+        }
+
+        size_type size() const
+        {
+            return count;
+        }
+
+        bool empty() const
+        {
+            return count == 0;
+        }
+
+        iterator begin()
+        {
+            return (T*)((uint8_t*)this + elements_offset());
+        }
+
+        const_iterator begin() const
+        {
+            return (const T*)((const uint8_t*)this + elements_offset());
+        }
+
+        iterator end()
+        {
+            return begin() + count;
+        }
+
+        const_iterator end() const
+        {
+            return begin() + count;
+        }
+
+        // return a managed pointer to the nth element
+        gc_ptr<T> operator [] (size_type n) const
+        {
+            BOOST_ASSERT(n < count);
+            return gc_ptr<T>(const_cast<T*>(begin() + n));
+        }
+
+        // The following expands to...
+        // static gc_array* create(gc& gc, size_type n)
+        // template <class A1, ... class A9>
+        // static gc_array* create(gc& gc, size_type n, const A1& a1, ... const A9& a9)
+        // ...
+        // which allocate and register an array of n elements, each constructed
+        // with the given arguments
+
+        #define GC_ARRAY_CREATE(Z, N, _) \
+        BOOST_PP_EXPR_IF(N, template<) BOOST_PP_ENUM_PARAMS(N, class A) BOOST_PP_EXPR_IF(N, >) \
+        static gc_array* create(gc& gc, size_type n BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_BINARY_PARAMS(N, const A, & a)) \
+        { \
+            detail::object_space space = gc_object_space<gc_array>(elements_offset() - sizeof(gc_array) + n * sizeof(T)); \
+            BOOST_ASSERT(space.size <= 0xffffffff); \
+            gc_array* pobj = new (space) gc_array(); \
+            try \
+            { \
+                for (; pobj->count < n; ++pobj->count) \
+                    pobj->adopt_element(::new ((void*)pobj->end()) T(BOOST_PP_ENUM_PARAMS(N, a))); \
+            } \
+            catch (...) \
+            { \
+                pobj->~gc_array(); \
+                gc_object::operator delete(pobj, space); \
+                throw; \
+            } \
+            gc.register_object(pobj, space.size); \
+            return pobj; \
+        }
+        BOOST_PP_REPEAT(BOOST_PP_INC(9), GC_ARRAY_CREATE, _)
+        #undef GC_ARRAY_CREATE
+
+    protected:
+        virtual void mark_members(gc* gc) const
+        {
+            for (const_iterator element = begin(), last = end(); element != last; ++element)
+                static_cast<const gc_object*>(element)->mark_members(gc);
+        }
+
+    private:
+        gc_array() : count(0)
+        {
+        }
+
+        gc_array(const gc_array&);
+        gc_array& operator = (const gc_array&);
+
+        // elements are stored after the array, aligned for T
+        static size_t elements_offset()
+        {
+            const size_t alignment = boost::alignment_of<T>::value;
+            return (sizeof(gc_array) + alignment - 1) / alignment * alignment;
+        }
+
+        // elements are never registered, and forward to the array instead
+        void adopt_element(const T* pelement)
+        {
+            const gc_object* pobj = static_cast<const gc_object*>(pelement);
+            pobj->header.element = true;
+            pobj->header.offset = (uint32_t)((const uint8_t*)pobj - (const uint8_t*)this);
+        }
+
+        size_type count;
+    };
+
+    // an array is trivially destructible or pointer-free if its elements are
+    template <class T>
+    struct gc_trivially_destructible< gc_array<T> > : public gc_trivially_destructible<T>
+    {
+    };
+
+    template <class T>
+    struct gc_pointer_free< gc_array<T> > : public gc_pointer_free<T>
+    {
+    };
+
+    // The following expands to...
+    // template <class T, class A1, ... class A9>
+    // gc_ptr< gc_array<T> > new_gc_array(size_t n, const A1& a1, ... const A9& a9)
+    // ...
+    // template <class T, class A1, ... class A9>
+    // gc_ptr< gc_array<T> > new_static_gc_array(size_t n, const A1& a1, ... const A9& a9)
+    // ...
+
+    #define NEW_GC_ARRAY(Z, N, _) \
+    template<class T BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_PARAMS(N, class A)> \
+    gc_ptr< gc_array<T> > new_gc_array(size_t n BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_BINARY_PARAMS(N, const A, & a)) \
+    { \
+        gc& gc = gc::get_gc(); \
+        gc_ptr< gc_array<T> > ptr(gc_array<T>::create(gc, n BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_PARAMS(N, a))); /* a root while collecting */ \
+        gc.collect(); \
+        return ptr; \
+    } \
+    template<class T BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_PARAMS(N, class A)> \
+    gc_ptr< gc_array<T> > new_static_gc_array(size_t n BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_BINARY_PARAMS(N, const A, & a)) \
+    { \
+        return gc_ptr< gc_array<T> >(gc_array<T>::create(gc::get_static_gc(), n BOOST_PP_COMMA_IF(N) BOOST_PP_ENUM_PARAMS(N, a))); \
+    }
+    BOOST_PP_REPEAT_2ND(BOOST_PP_INC(9), NEW_GC_ARRAY, _)
+}
+
+#endif
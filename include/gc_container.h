@@ -7,10 +7,90 @@
 #ifndef _LUTZE_GC_CONTAINER
 #define _LUTZE_GC_CONTAINER
 
+#include <boost/next_prior.hpp>
 #include "gc.h"
 
 namespace lutze
 {
+    namespace detail
+    {
+        // lock held while the elements of a container are traced, and while
+        // its storage changes if a mark may be tracing it on another thread,
+        // so a concurrent mark never walks storage freed by the mutator
+        class container_lock
+        {
+        public:
+            container_lock() : locked(false)
+            {
+            }
+
+            // copies are separate containers, so never share a lock
+            container_lock(const container_lock&) : locked(false)
+            {
+            }
+
+            container_lock& operator = (const container_lock&)
+            {
+                return *this;
+            }
+
+            void lock() const
+            {
+                while (locked.exchange(true, boost::memory_order_acquire))
+                    boost::this_thread::yield();
+            }
+
+            void unlock() const
+            {
+                locked.store(false, boost::memory_order_release);
+            }
+
+        private:
+            mutable boost::atomic<bool> locked;
+        };
+
+        // hold the lock of a container while its elements are traced
+        class scoped_container_trace
+        {
+        public:
+            explicit scoped_container_trace(const container_lock& lock) : held(lock)
+            {
+                held.lock();
+            }
+
+            ~scoped_container_trace()
+            {
+                held.unlock();
+            }
+
+        private:
+            const container_lock& held;
+        };
+
+        // hold the lock of a container while its storage changes, if any gc
+        // is marking (only a concurrent mark traces on another thread, but
+        // checking for one would race with it starting on the owner's thread)
+        class scoped_container_change
+        {
+        public:
+            template <class C>
+            explicit scoped_container_change(const C* container) : held(container != NULL && gc::container_lock_active() ? &container->structure_lock : NULL)
+            {
+                if (held != NULL)
+                    held->lock();
+            }
+
+            ~scoped_container_change()
+            {
+                if (held != NULL)
+                    held->unlock();
+            }
+
+        private:
+            const container_lock* held;
+        };
+    }
+
     template <class T>
     class container_ptr : public gc_container, public gc_ptr<T>
     {
@@ -45,6 +125,8 @@ namespace lutze
 
         void clear()
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            detail::scoped_container_change change(this->px);
             this->px->clear();
         }
 
@@ -75,9 +157,15 @@ namespace lutze
     protected:
         virtual void mark_members(gc* gc) const
         {
+            detail::scoped_container_trace trace(structure_lock);
             for (typename T::const_iterator obj = this->begin(), last = this->end(); obj != last; ++obj)
                 gc->mark(*obj);
         }
+
+    private:
+        mutable detail::container_lock structure_lock;
+
+        friend class detail::scoped_container_change;
     };
 
     template <class T>
@@ -105,11 +193,17 @@ namespace lutze
         template <class Iter>
         void assign(Iter first, Iter last)
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            gc::write_barrier_range(this->px, first, last);
+            detail::scoped_container_change change(this->px);
             this->px->assign(first, last);
         }
 
         void assign(size_type n, const value_type& x)
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             this->px->assign(n, x);
         }
 
@@ -135,11 +229,15 @@ namespace lutze
 
         iterator erase(iterator position)
         {
+            gc::write_barrier(*position);
+            detail::scoped_container_change change(this->px);
             return this->px->erase(position);
         }
 
         iterator erase(iterator first, iterator last)
         {
+            gc::write_barrier_range(first, last);
+            detail::scoped_container_change change(this->px);
             return this->px->erase(first, last);
         }
 
@@ -155,17 +253,23 @@ namespace lutze
 
         iterator insert(iterator position, const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(position, x);
         }
 
         void insert(iterator position, size_type n, const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(position, n, x);
         }
 
         template <class Iter>
         void insert(iterator position, Iter first, Iter last)
         {
+            gc::write_barrier_range(this->px, first, last);
+            detail::scoped_container_change change(this->px);
             this->px->insert(position, first, last);
         }
 
@@ -181,21 +285,30 @@ namespace lutze
 
         void pop_back()
         {
+            gc::write_barrier(this->px->back());
+            detail::scoped_container_change change(this->px);
             this->px->pop_back();
         }
 
         void push_back(const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             this->px->push_back(x);
         }
 
         void reserve(size_type n)
         {
+            detail::scoped_container_change change(this->px);
             this->px->reserve(n);
         }
 
         void resize(size_type n, const value_type& x = value_type())
         {
+            if (gc::write_barrier_active() && n < this->px->size())
+                gc::write_barrier_range(boost::next(this->px->begin(), n), this->px->end());
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             this->px->resize(n, x);
         }
 
@@ -224,7 +337,7 @@ namespace lutze
     vector_ptr<T> new_vector_placeholder(gc& gc, typename T::size_type n = 0, const typename T::value_type& x = typename T::value_type())
     {
         vector_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.resize(n, x);
         return container;
     }
@@ -245,7 +358,7 @@ namespace lutze
     vector_ptr<T> new_vector_placeholder(gc& gc, Iter first, Iter last)
     {
         vector_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.assign(first, last);
         return container;
     }
@@ -279,11 +392,15 @@ namespace lutze
 
         void pop_front()
         {
+            gc::write_barrier(this->px->front());
+            detail::scoped_container_change change(this->px);
             this->px->pop_front();
         }
 
         void push_front(const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             this->px->push_front(x);
         }
     };
@@ -292,7 +409,7 @@ namespace lutze
     deque_ptr<T> new_deque_placeholder(gc& gc, typename T::size_type n = 0, const typename T::value_type& x = typename T::value_type())
     {
         deque_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.resize(n, x);
         return container;
     }
@@ -313,7 +430,7 @@ namespace lutze
     deque_ptr<T> new_deque_placeholder(gc& gc, Iter first, Iter last)
     {
         deque_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.assign(first, last);
         return container;
     }
@@ -349,60 +466,85 @@ namespace lutze
 
         void merge(list_ptr& x)
         {
+            gc::write_barrier_range(this->px, x.begin(), x.end());
+            detail::scoped_container_change change(this->px);
+            detail::scoped_container_change change_other(x.px != this->px ? x.px : NULL);
             this->px->merge(*x);
         }
 
         template <class Comp>
         void merge(list_ptr& x, Comp comp)
         {
+            gc::write_barrier_range(this->px, x.begin(), x.end());
+            detail::scoped_container_change change(this->px);
+            detail::scoped_container_change change_other(x.px != this->px ? x.px : NULL);
             this->px->merge(*x, comp);
         }
 
         void remove(const value_type& x)
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            detail::scoped_container_change change(this->px);
             this->px->remove(x);
         }
 
         template <class Pred>
         void remove_if(const value_type& x, Pred pred)
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            detail::scoped_container_change change(this->px);
             this->px->remove_if(x, pred);
         }
 
         void sort()
         {
+            detail::scoped_container_change change(this->px);
             this->px->sort();
         }
 
         template <class Comp>
         void sort(Comp comp)
         {
+            detail::scoped_container_change change(this->px);
             this->px->sort(comp);
         }
 
         void splice(iterator position, list_ptr& x)
         {
+            gc::write_barrier_range(this->px, x.begin(), x.end());
+            detail::scoped_container_change change(this->px);
+            detail::scoped_container_change change_other(x.px != this->px ? x.px : NULL);
             this->px->splice(position, *x);
         }
 
         void splice(iterator position, list_ptr& x, iterator i)
         {
+            gc::write_barrier(this->px, *i);
+            detail::scoped_container_change change(this->px);
+            detail::scoped_container_change change_other(x.px != this->px ? x.px : NULL);
             this->px->splice(position, *x, i);
         }
 
         void splice(iterator position, list_ptr& x, iterator first, iterator last)
         {
+            gc::write_barrier_range(this->px, first, last);
+            detail::scoped_container_change change(this->px);
+            detail::scoped_container_change change_other(x.px != this->px ? x.px : NULL);
             this->px->splice(position, *x, first, last);
         }
 
         void unique()
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            detail::scoped_container_change change(this->px);
             this->px->unique();
         }
 
         template <class Pred>
         void unique(Pred pred)
         {
+            gc::write_barrier_range(this->px->begin(), this->px->end());
+            detail::scoped_container_change change(this->px);
             this->px->unique(pred);
         }
     };
@@ -411,7 +553,7 @@ namespace lutze
     list_ptr<T> new_list_placeholder(gc& gc, typename T::size_type n = 0, const typename T::value_type& x = typename T::value_type())
     {
         list_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.resize(n, x);
         return container;
     }
@@ -432,7 +574,7 @@ namespace lutze
     list_ptr<T> new_list_placeholder(gc& gc, Iter first, Iter last)
     {
         list_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.assign(first, last);
         return container;
     }
@@ -476,16 +618,26 @@ namespace lutze
 
         void erase(iterator position)
         {
+            gc::write_barrier(*position);
+            detail::scoped_container_change change(this->px);
             this->px->erase(position);
         }
 
         size_type erase(const value_type& x)
         {
+            if (gc::write_barrier_active())
+            {
+                std::pair<iterator, iterator> range = this->px->equal_range(x);
+                gc::write_barrier_range(range.first, range.second);
+            }
+            detail::scoped_container_change change(this->px);
             return this->px->erase(x);
         }
 
         void erase(iterator first, iterator last)
         {
+            gc::write_barrier_range(first, last);
+            detail::scoped_container_change change(this->px);
             this->px->erase(first, last);
         }
 
@@ -496,17 +648,23 @@ namespace lutze
 
         std::pair<iterator, bool> insert(const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(x);
         }
 
         iterator insert(iterator position, const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(position, x);
         }
 
         template <class Iter>
         void insert(Iter first, Iter last)
         {
+            gc::write_barrier_range(this->px, first, last);
+            detail::scoped_container_change change(this->px);
             this->px->insert(first, last);
         }
 
@@ -525,7 +683,7 @@ namespace lutze
     set_ptr<T> new_set_placeholder(gc& gc)
     {
         set_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         return container;
     }
 
@@ -545,7 +703,7 @@ namespace lutze
     set_ptr<T> new_set_placeholder(gc& gc, Iter first, Iter last)
     {
         set_ptr<T> container(new single_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.insert(first, last);
         return container;
     }
@@ -568,12 +726,18 @@ namespace lutze
     protected:
         virtual void mark_members(gc* gc) const
         {
+            detail::scoped_container_trace trace(structure_lock);
             for (typename T::const_iterator obj = this->begin(), last = this->end(); obj != last; ++obj)
             {
                 gc->mark(obj->first);
                 gc->mark(obj->second);
             }
         }
+
+    private:
+        mutable detail::container_lock structure_lock;
+
+        friend class detail::scoped_container_change;
     };
 
     template <class T>
@@ -613,16 +777,26 @@ namespace lutze
 
         void erase(iterator position)
         {
+            gc::write_barrier(*position);
+            detail::scoped_container_change change(this->px);
             this->px->erase(position);
         }
 
         size_type erase(const key_type& x)
         {
+            if (gc::write_barrier_active())
+            {
+                std::pair<iterator, iterator> range = this->px->equal_range(x);
+                gc::write_barrier_range(range.first, range.second);
+            }
+            detail::scoped_container_change change(this->px);
             return this->px->erase(x);
         }
 
         void erase(iterator first, iterator last)
         {
+            gc::write_barrier_range(first, last);
+            detail::scoped_container_change change(this->px);
             this->px->erase(first, last);
         }
 
@@ -638,17 +812,23 @@ namespace lutze
 
         std::pair<iterator, bool> insert(const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(x);
         }
 
         iterator insert(iterator position, const value_type& x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return this->px->insert(position, x);
         }
 
         template <class Iter>
         void insert(Iter first, Iter last)
         {
+            gc::write_barrier_range(this->px, first, last);
+            detail::scoped_container_change change(this->px);
             this->px->insert(first, last);
         }
 
@@ -669,6 +849,8 @@ namespace lutze
 
         mapped_type& operator [] (const key_type &x)
         {
+            gc::write_barrier(this->px, x);
+            detail::scoped_container_change change(this->px);
             return (*this->px)[x];
         }
 
@@ -682,7 +864,7 @@ namespace lutze
     map_ptr<T> new_map_placeholder(gc& gc)
     {
         map_ptr<T> container(new pair_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         return container;
     }
 
@@ -702,7 +884,7 @@ namespace lutze
     map_ptr<T> new_map_placeholder(gc& gc, Iter first, Iter last)
     {
         map_ptr<T> container(new pair_container<T>());
-        gc.register_object(static_cast<gc_object*>(container.get()));
+        gc.register_object(get_pointer(container));
         container.insert(first, last);
         return container;
     }
@@ -0,0 +1,63 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_FINALIZER
+#define _LUTZE_GC_FINALIZER
+
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace lutze
+{
+    class gc_object;
+
+    namespace detail
+    {
+        // threads that destroy batches of released objects, so destructors
+        // and frees are kept off the collecting thread
+        class finalizer_pool
+        {
+        public:
+            finalizer_pool();
+            ~finalizer_pool();
+
+            typedef std::vector<const gc_object*> object_list;
+
+            // stop existing threads, once every queued batch is destroyed,
+            // and start the given number of new ones
+            void resize(uint32_t threads);
+
+            // take the given objects to be destroyed, leaving the list empty
+            // (with the storage of a batch already destroyed, if any); returns
+            // false without taking them if there are no threads
+            bool submit(object_list& objects);
+
+            // block until every object submitted has been destroyed
+            void flush();
+
+        private:
+            finalizer_pool(const finalizer_pool&);
+            finalizer_pool& operator = (const finalizer_pool&);
+
+            void finalizer_main();
+
+            boost::mutex mutex;
+            boost::condition_variable batch_ready;
+            boost::condition_variable batch_done;
+            std::vector<boost::thread*> finalizers;
+            std::vector<object_list> batches; // submitted, not yet taken
+            std::vector<object_list> idle; // destroyed, kept for their storage
+            uint64_t submitted; // batches submitted
+            uint64_t finished; // batches destroyed
+            bool stopping;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,129 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_MARK_POOL
+#define _LUTZE_GC_MARK_POOL
+
+#include <cstddef>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace lutze
+{
+    class gc_object;
+
+    namespace detail
+    {
+        // work-stealing deque of objects waiting to be marked (Chase and Lev),
+        // where the owning worker pushes and takes at the bottom and any other
+        // worker steals from the top
+        class mark_deque
+        {
+        public:
+            mark_deque();
+            ~mark_deque();
+
+            // add object at the bottom (owner only)
+            void push(const gc_object* pobj);
+
+            // remove most recently pushed object, returning false if empty
+            // (owner only)
+            bool take(const gc_object*& pobj);
+
+            // remove least recently pushed object, returning false if empty or
+            // if another worker removed it first
+            bool steal(const gc_object*& pobj);
+
+            // return true if no objects remain (may be stale when read by
+            // other workers)
+            bool empty() const;
+
+            // release buffers outgrown while marking (only while no worker is
+            // using the deque)
+            void reset();
+
+        private:
+            mark_deque(const mark_deque&);
+            mark_deque& operator = (const mark_deque&);
+
+            struct buffer
+            {
+                explicit buffer(size_t size) : mask(size - 1), items(new boost::atomic<const gc_object*>[size])
+                {
+                }
+
+                ~buffer()
+                {
+                    delete [] items;
+                }
+
+                size_t mask;
+                boost::atomic<const gc_object*>* items;
+            };
+
+            // replace the buffer with one twice the size, keeping the old
+            // buffer until reset since other workers may still read it
+            buffer* grow(buffer* old, intptr_t top, intptr_t bottom);
+
+            boost::atomic<intptr_t> top;
+            boost::atomic<intptr_t> bottom;
+            boost::atomic<buffer*> items;
+            std::vector<buffer*> retired;
+        };
+
+        // helper threads that mark alongside a collecting thread, each with
+        // its own mark deque (the collecting thread uses deque 0)
+        class mark_pool
+        {
+        public:
+            mark_pool();
+            ~mark_pool();
+
+            // task run by each worker, given its index and the number of workers
+            typedef boost::function<void (uint32_t, uint32_t)> task_type;
+
+            // stop existing helpers and start the given number of new ones
+            void resize(uint32_t helpers);
+
+            // return the number of workers, including the calling thread
+            uint32_t workers() const;
+
+            // return the mark deque of the given worker
+            mark_deque& deque(uint32_t worker);
+
+            // run task on every helper and on the calling thread as worker 0,
+            // returning once all have finished; returns false without running
+            // if there are no helpers or another thread is using the pool
+            bool run(const task_type& task);
+
+        private:
+            mark_pool(const mark_pool&);
+            mark_pool& operator = (const mark_pool&);
+
+            // wait for tasks newer than the generation current when started
+            // (run may begin a task before a new helper first waits)
+            void helper_main(uint32_t worker, uint64_t last_generation);
+
+            boost::mutex run_mutex; // held while a task runs or the pool resizes
+            boost::mutex state_mutex;
+            boost::condition_variable task_ready;
+            boost::condition_variable task_done;
+            std::vector<boost::thread*> helpers;
+            std::vector<mark_deque*> deques;
+            task_type task;
+            uint64_t generation; // incremented for each task
+            uint32_t running; // helpers yet to finish the current task
+            bool stopping;
+        };
+    }
+}
+
+#endif
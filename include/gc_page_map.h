@@ -0,0 +1,131 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_PAGE_MAP
+#define _LUTZE_GC_PAGE_MAP
+
+#include <cstddef>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+namespace lutze
+{
+    class gc_object;
+
+    namespace detail
+    {
+        // page-granular side table of registered objects, answering whether an
+        // address (including an interior pointer) belongs to an object and where
+        // that object starts using a radix walk and a bitmap search; records and
+        // their mark words are kept in dense parallel arrays, so a sweep reads
+        // the mark words sequentially
+        class page_map
+        {
+        public:
+            page_map();
+            ~page_map();
+
+            // registered object, with the address range of its allocation
+            struct record
+            {
+                const gc_object* object;
+                uintptr_t start;
+                uint32_t size;
+                uint32_t flags; // owner flags, cleared on insert
+            };
+
+            typedef std::vector<record>::iterator iterator;
+            typedef std::vector<record>::const_iterator const_iterator;
+
+            // register object occupying size bytes from start, returning the
+            // (non-zero) index of its record
+            uint32_t insert(const gc_object* object, const void* start, size_t size);
+
+            // unregister the object with the given record index, moving the
+            // last record into its place and returning the moved object (or
+            // NULL when the erased record was last)
+            const gc_object* erase(uint32_t index);
+
+            // return the record with the given index
+            record& operator [] (uint32_t index)
+            {
+                return records[index];
+            }
+
+            // return the mark word of the record with the given index, zero
+            // until first marked
+            uint32_t& mark(uint32_t index)
+            {
+                return marks[index];
+            }
+
+            // append the index of every record whose mark word is not token
+            void unmarked(uint32_t token, std::vector<uint32_t>& indices) const;
+
+            // return object containing the given address, or NULL
+
+            record* find(const void* ptr) const;
+
+            // resolve a batch of addresses, overlapping the page and record
+            // loads of each address with those of the others
+            void find(const uintptr_t* addresses, size_t count, record** results) const;
+
+            // number of registered objects
+            size_t size() const;
+
+            // iterate all records
+            iterator begin();
+            iterator end();
+            const_iterator begin() const;
+            const_iterator end() const;
+
+            // log2 of the mapped page size
+            static const uintptr_t page_shift = 12;
+
+        private:
+            page_map(const page_map&);
+            page_map& operator = (const page_map&);
+
+            static const uintptr_t granule_shift = 4;
+            static const uintptr_t granules = 1 << (page_shift - granule_shift);
+            static const uintptr_t level_bits = 12;
+            static const uintptr_t level_size = 1 << level_bits;
+
+            // object starts within a single page, plus the object (if any)
+            // that spans into the page from a previous one
+            struct page_info
+            {
+                uint64_t starts[granules / 64];
+                uint32_t records[granules];
+                uint32_t spanning;
+                uint32_t count;
+            };
+
+            struct page_leaf
+            {
+                page_info* pages[level_size];
+            };
+
+            struct page_directory
+            {
+                page_leaf* leaves[level_size];
+            };
+
+            page_info* find_page(uintptr_t page) const;
+            uint32_t find_index(const page_info* info, uintptr_t address) const;
+            page_info* get_page(uintptr_t page);
+            void release_page(uintptr_t page);
+
+            std::vector<page_directory*> directories;
+            std::vector<record> records;
+            std::vector<uint32_t> marks; // parallel to records
+
+            std::vector<page_info*> free_pages; // released pages kept for reuse
+        };
+    }
+}
+
+#endif
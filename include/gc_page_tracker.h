@@ -0,0 +1,67 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_PAGE_TRACKER
+#define _LUTZE_GC_PAGE_TRACKER
+
+#include <cstddef>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+namespace lutze
+{
+    // source of written-page information, used by a gc to avoid retracing
+    // objects whose memory is unchanged since the previous collection
+    class page_tracker
+    {
+    public:
+        virtual ~page_tracker()
+        {
+        }
+
+        // prepare to answer queries for the current interval, returning false
+        // if the pages written during it are no longer known
+        virtual bool begin() = 0;
+
+        // return true if any page overlapping the range was written during
+        // the current interval
+        virtual bool written(const void* ptr, size_t size) = 0;
+
+        // start a new interval, returning false if tracking is unavailable
+        virtual bool reset() = 0;
+    };
+
+    // tracks written pages using the Linux soft-dirty bits, which are cleared
+    // through /proc/self/clear_refs and read from /proc/self/pagemap
+    class soft_dirty_tracker : public page_tracker
+    {
+    public:
+        soft_dirty_tracker();
+        virtual ~soft_dirty_tracker();
+
+        // return true if the running kernel maintains soft-dirty bits
+        static bool supported();
+
+        virtual bool begin();
+        virtual bool written(const void* ptr, size_t size);
+        virtual bool reset();
+
+    private:
+        soft_dirty_tracker(const soft_dirty_tracker&);
+        soft_dirty_tracker& operator = (const soft_dirty_tracker&);
+
+        // return pagemap entry for the given page, reading a block at a time
+        uint64_t page_entry(uintptr_t page);
+
+        int pagemap;
+        uintptr_t page_shift;
+        uint32_t epoch; // process-wide clear count when this tracker last cleared
+        uintptr_t block_first; // first page of cached pagemap block
+        std::vector<uint64_t> block;
+    };
+}
+
+#endif
@@ -7,6 +7,12 @@
 #ifndef _LUTZE_GC_PTR
 #define _LUTZE_GC_PTR
 
+#if defined(_MSC_VER)
+#define GC_THREAD_LOCAL __declspec(thread)
+#else
+#define GC_THREAD_LOCAL __thread
+#endif
+
 namespace lutze
 {
     using boost::int32_t;
@@ -16,6 +22,8 @@ namespace lutze
     using boost::int8_t;
     using boost::uint8_t;
 
+    class gc_object;
+
     namespace detail
     {
         struct static_cast_tag {};
@@ -57,6 +65,80 @@ namespace lutze
         struct gc_ptr_enable_if_convertible : public gc_ptr_enable_if_convertible_impl<gc_ptr_convertible<Y, T>::value>
         {
         };
+
+        // number of gc instances marking incrementally or concurrently, or
+        // collecting a nursery, so stores only take the write barrier while
+        // one needs it
+        extern boost::atomic<uint32_t> write_barrier_users;
+
+        // queue object to be marked by its owner's incremental or concurrent
+        // mark, and remember where a young object was stored (slot is NULL
+        // for an object removed rather than stored)
+        void barrier_object(const void* slot, const gc_object* pobj);
+
+        // shade object overwritten or removed while a mark is in progress, so
+        // an object reachable when a concurrent mark began is never missed
+        inline void write_barrier(const gc_object* pobj)
+        {
+            if (pobj != 0 && write_barrier_users.load(boost::memory_order_relaxed) != 0)
+                barrier_object(0, pobj);
+        }
+
+        // shade object stored at slot while a mark is in progress, so a
+        // traced object never references an object left unmarked, and
+        // remember the slot if the object is young, so a minor collection
+        // finds it when slot belongs to an old object
+        inline void write_barrier(const void* slot, const gc_object* pobj)
+        {
+            if (pobj != 0 && write_barrier_users.load(boost::memory_order_relaxed) != 0)
+                barrier_object(slot, pobj);
+        }
+
+        #if defined(GC_PRECISE_ROOTS)
+
+        // entry in the thread-local chain of gc_ptr instances with automatic
+        // storage, walked by the collector in place of scanning the stack
+        struct gc_root
+        {
+            gc_root* prev;
+            gc_root* next;
+            const void* const* slot; // NULL when not linked
+        };
+
+        // head of the root chain for the current thread
+        extern GC_THREAD_LOCAL gc_root* root_chain;
+
+        // return true if ptr lies on the stack the current thread is running on
+        bool is_stack_address(const void* ptr);
+
+        inline void link_root(gc_root& root, const void* const* slot)
+        {
+            if (!is_stack_address(&root))
+            {
+                root.slot = 0;
+                return;
+            }
+            root.slot = slot;
+            root.prev = 0;
+            root.next = root_chain;
+            if (root_chain != 0)
+                root_chain->prev = &root;
+            root_chain = &root;
+        }
+
+        inline void unlink_root(gc_root& root)
+        {
+            if (root.slot == 0)
+                return;
+            if (root.prev != 0)
+                root.prev->next = root.next;
+            else
+                root_chain = root.next;
+            if (root.next != 0)
+                root.next->prev = root.prev;
+        }
+
+        #endif
     }
 
     template <class T>
@@ -68,59 +150,72 @@ namespace lutze
 
         gc_ptr(T* p = 0) : px(p), padding(0)
         {
+            link_root();
+        }
+
+        gc_ptr(const gc_ptr& rhs) : px(rhs.px), padding(0)
+        {
+            link_root();
         }
 
         template <class U>
         gc_ptr(const gc_ptr<U>& rhs, typename detail::gc_ptr_enable_if_convertible<U, T>::type = detail::gc_ptr_empty()) : px(rhs.get())
         {
+            link_root();
         }
 
         template <class U>
         gc_ptr(const gc_ptr<U>& rhs, detail::static_cast_tag): px(static_cast<T*>(rhs.get()))
         {
+            link_root();
         }
 
         template <class U>
         gc_ptr(const gc_ptr<U>& rhs, detail::const_cast_tag): px(const_cast<T*>(rhs.get()))
         {
+            link_root();
         }
 
         template <class U>
         gc_ptr(const gc_ptr<U>& rhs, detail::dynamic_cast_tag): px(dynamic_cast<T*>(rhs.get()))
         {
+            link_root();
         }
 
         template <class U>
         gc_ptr(const gc_ptr<U>& rhs, detail::reinterpret_cast_tag): px(reinterpret_cast<T*>(rhs.get()))
         {
+            link_root();
         }
 
         ~gc_ptr()
         {
+            unlink_root();
             px = 0;
         }
 
         gc_ptr& operator = (const gc_ptr& rhs)
         {
-            this_type(rhs).swap(*this);
+            assign(rhs.px);
             return *this;
         }
 
         template <class Y>
         gc_ptr& operator = (const gc_ptr<Y>& rhs)
         {
-            this_type(rhs).swap(*this);
+            assign(rhs.get());
             return *this;
         }
 
         void reset()
         {
+            detail::write_barrier(px);
             px = 0;
         }
 
         void reset(T* rhs)
         {
-            this_type(rhs).swap(*this);
+            assign(rhs);
         }
 
         T* get() const
@@ -139,8 +234,12 @@ namespace lutze
             return px;
         }
 
+        // each pointer moves into storage that may belong to an object
+        // already marked, or to an old object
         void swap(gc_ptr& rhs)
         {
+            detail::write_barrier(&rhs.px, px);
+            detail::write_barrier(&px, rhs.px);
             std::swap(px, rhs.px);
         }
 
@@ -157,10 +256,43 @@ namespace lutze
         }
 
     protected:
+        // assignment and reset store through here, passing the overwritten
+        // and the stored pointer to the write barrier
+        void assign(T* rhs)
+        {
+            detail::write_barrier(px);
+            detail::write_barrier(&px, rhs);
+            px = rhs;
+        }
+
+        #if defined(GC_PRECISE_ROOTS)
+        void link_root()
+        {
+            detail::link_root(root, (const void* const*)&px);
+        }
+
+        void unlink_root()
+        {
+            detail::unlink_root(root);
+        }
+        #else
+        void link_root()
+        {
+        }
+
+        void unlink_root()
+        {
+        }
+        #endif
+
         T* px;
 
         // padding is required for windows because of stack address space pollution
         uint8_t padding;
+
+        #if defined(GC_PRECISE_ROOTS)
+        detail::gc_root root;
+        #endif
     };
 
     template <class T1, class T2>
@@ -0,0 +1,60 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_SCAN
+#define _LUTZE_GC_SCAN
+
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+namespace lutze
+{
+    namespace detail
+    {
+        // copy every stack word whose value lies within [heap_min, heap_max]
+        // into candidates, which must have room for count words, and return
+        // the number of words copied
+        typedef size_t (*scan_kernel)(const uintptr_t* words, size_t count, uintptr_t heap_min, uintptr_t heap_max, uintptr_t* candidates);
+
+        // portable scan kernel, used when no vector instructions are available
+        size_t scan_words_scalar(const uintptr_t* words, size_t count, uintptr_t heap_min, uintptr_t heap_max, uintptr_t* candidates);
+
+        // copy the index of every mark word not equal to token into unmarked,
+        // which must have room for count indices, numbering the first word as
+        // first, and return the number of indices copied
+        typedef size_t (*sweep_kernel)(const uint32_t* marks, size_t count, uint32_t token, uint32_t first, uint32_t* unmarked);
+
+        // portable sweep kernel, used when no vector instructions are available
+        size_t sweep_marks_scalar(const uint32_t* marks, size_t count, uint32_t token, uint32_t first, uint32_t* unmarked);
+
+        // scan and sweep kernels using one instruction set
+        struct scan_kernel_entry
+        {
+            scan_kernel kernel;
+            sweep_kernel sweep;
+            const char* name;
+        };
+
+        static const size_t max_scan_kernels = 3;
+
+        // copy every kernel entry supported by the running processor into
+        // kernels, which must have room for max_scan_kernels entries, fastest
+        // first and ending with the portable kernels, and return the number
+        // of entries copied
+        size_t get_supported_kernels(scan_kernel_entry* kernels);
+
+        // return the fastest scan kernel supported by the running processor
+        scan_kernel get_scan_kernel();
+
+        // return the fastest sweep kernel supported by the running processor
+        sweep_kernel get_sweep_kernel();
+
+        // return the name of the scan kernel selected for this processor
+        const char* get_scan_kernel_name();
+    }
+}
+
+#endif
@@ -0,0 +1,251 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LUTZE_GC_STRING
+#define _LUTZE_GC_STRING
+
+#include <cstring>
+#include <string>
+#include "gc.h"
+
+namespace lutze
+{
+    class gc_string;
+    class gc_blob;
+
+    gc_ptr<gc_string> new_gc_string_placeholder(gc& gc, const char* chars, size_t length);
+    gc_ptr<gc_blob> new_gc_blob_placeholder(gc& gc, const void* bytes, size_t size);
+
+    // immutable string whose characters (followed by a terminating null) are
+    // stored inline after the object, in a single allocation
+    class gc_string : public gc_object
+    {
+    public:
+        typedef size_t size_type;
+        typedef const char* const_iterator;
+
+        const char* c_str() const
+        {
+            return (const char*)(this + 1);
+        }
+
+        const char* data() const
+        {
+            return c_str();
+        }
+
+        size_type size() const
+        {
+            return string_size;
+        }
+
+        size_type length() const
+        {
+            return string_size;
+        }
+
+        bool empty() const
+        {
+            return string_size == 0;
+        }
+
+        const_iterator begin() const
+        {
+            return c_str();
+        }
+
+        const_iterator end() const
+        {
+            return c_str() + string_size;
+        }
+
+        char operator [] (size_type n) const
+        {
+            return c_str()[n];
+        }
+
+        std::string str() const
+        {
+            return std::string(c_str(), string_size);
+        }
+
+    private:
+        gc_string(const char* chars, size_type length) : string_size(length)
+        {
+            std::memcpy((char*)(this + 1), chars, length);
+            ((char*)(this + 1))[length] = 0;
+        }
+
+        gc_string(const gc_string&);
+        gc_string& operator = (const gc_string&);
+
+        size_type string_size;
+
+        friend gc_ptr<gc_string> new_gc_string_placeholder(gc& gc, const char* chars, size_t length);
+    };
+
+    // fixed size byte buffer (such as an encoded posting list or an array of
+    // numbers) stored inline after the object, in a single allocation, and
+    // aligned to pointers
+    class gc_blob : public gc_object
+    {
+    public:
+        typedef size_t size_type;
+        typedef uint8_t* iterator;
+        typedef const uint8_t* const_iterator;
+
+        uint8_t* data()
+        {
+            return (uint8_t*)(this + 1);
+        }
+
+        const uint8_t* data() const
+        {
+            return (const uint8_t*)(this + 1);
+        }
+
+        size_type size() const
+        {
+            return blob_size;
+        }
+
+        bool empty() const
+        {
+            return blob_size == 0;
+        }
+
+        iterator begin()
+        {
+            return data();
+        }
+
+        const_iterator begin() const
+        {
+            return data();
+        }
+
+        iterator end()
+        {
+            return data() + blob_size;
+        }
+
+        const_iterator end() const
+        {
+            return data() + blob_size;
+        }
+
+        uint8_t& operator [] (size_type n)
+        {
+            return data()[n];
+        }
+
+        uint8_t operator [] (size_type n) const
+        {
+            return data()[n];
+        }
+
+    private:
+        gc_blob(const void* bytes, size_type size) : blob_size(size)
+        {
+            if (bytes != NULL)
+                std::memcpy((uint8_t*)(this + 1), bytes, size);
+            else
+                std::memset((uint8_t*)(this + 1), 0, size);
+        }
+
+        gc_blob(const gc_blob&);
+        gc_blob& operator = (const gc_blob&);
+
+        size_type blob_size;
+
+        friend gc_ptr<gc_blob> new_gc_blob_placeholder(gc& gc, const void* bytes, size_t size);
+    };
+
+    // neither holds managed pointers or state needing destruction, so both
+    // are allocated in the pointer-free space and simply freed once released
+    template <>
+    struct gc_trivially_destructible<gc_string> : public boost::true_type
+    {
+    };
+
+    template <>
+    struct gc_pointer_free<gc_string> : public boost::true_type
+    {
+    };
+
+    template <>
+    struct gc_trivially_destructible<gc_blob> : public boost::true_type
+    {
+    };
+
+    template <>
+    struct gc_pointer_free<gc_blob> : public boost::true_type
+    {
+    };
+
+    inline gc_ptr<gc_string> new_gc_string_placeholder(gc& gc, const char* chars, size_t length)
+    {
+        gc_string* pobj = new (gc_object_space<gc_string>(length + 1)) gc_string(chars, length);
+        gc.register_object(pobj, sizeof(gc_string) + length + 1);
+        return gc_ptr<gc_string>(pobj);
+    }
+
+    inline gc_ptr<gc_string> new_gc_string(const char* chars, size_t length)
+    {
+        gc& gc = gc::get_gc();
+        gc_ptr<gc_string> ptr = new_gc_string_placeholder(gc, chars, length); // a root while collecting
+        gc.collect();
+        return ptr;
+    }
+
+    inline gc_ptr<gc_string> new_gc_string(const char* chars)
+    {
+        return new_gc_string(chars, std::strlen(chars));
+    }
+
+    inline gc_ptr<gc_string> new_gc_string(const std::string& str)
+    {
+        return new_gc_string(str.data(), str.size());
+    }
+
+    inline gc_ptr<gc_string> new_static_gc_string(const char* chars, size_t length)
+    {
+        return new_gc_string_placeholder(gc::get_static_gc(), chars, length);
+    }
+
+    inline gc_ptr<gc_string> new_static_gc_string(const char* chars)
+    {
+        return new_static_gc_string(chars, std::strlen(chars));
+    }
+
+    inline gc_ptr<gc_string> new_static_gc_string(const std::string& str)
+    {
+        return new_static_gc_string(str.data(), str.size());
+    }
+
+    inline gc_ptr<gc_blob> new_gc_blob_placeholder(gc& gc, const void* bytes, size_t size)
+    {
+        gc_blob* pobj = new (gc_object_space<gc_blob>(size)) gc_blob(bytes, size);
+        gc.register_object(pobj, sizeof(gc_blob) + size);
+        return gc_ptr<gc_blob>(pobj);
+    }
+
+    // copy size bytes, or zero them if bytes is NULL
+    inline gc_ptr<gc_blob> new_gc_blob(size_t size, const void* bytes = NULL)
+    {
+        gc& gc = gc::get_gc();
+        gc_ptr<gc_blob> ptr = new_gc_blob_placeholder(gc, bytes, size); // a root while collecting
+        gc.collect();
+        return ptr;
+    }
+
+    inline gc_ptr<gc_blob> new_static_gc_blob(size_t size, const void* bytes = NULL)
+    {
+        return new_gc_blob_placeholder(gc::get_static_gc(), bytes, size);
+    }
+}
+
+#endif
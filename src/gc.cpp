@@ -5,28 +5,23 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include "gc.h"
+#include <algorithm>
+#include <cstring>
+#include <boost/atomic/atomic_ref.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "gc_finalizer.h"
+#include "gc_mark_pool.h"
+#include "gc_scan.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #define _GC_VERSION "2.2.0"
 
-#if defined(_WIN32) || defined(_WIN64) || defined(BOOST_THREAD_WIN32)
-#define GC_PLATFORM_WINDOWS
-#endif
-#if defined(__SVR4) && defined(__sun) || defined(BOOST_THREAD_SOLARIS)
-#define GC_PLATFORM_SOLARIS
-#endif
-#if defined(__sparc__) || defined(__sparc)
-#define GC_PLATFORM_SPARC
-#endif
-#if defined(__ppc__) || defined(__powerpc__) || (__ppc64__) || (__powerpc64__)
-#define GC_PLATFORM_POWERPC
-#endif
-#if defined(_MAC) || defined(BOOST_THREAD_MACOS)
-#define GC_PLATFORM_MAC
-#endif
-#if defined(LINUX) || defined(BOOST_THREAD_LINUX)
-#define GC_PLATFORM_LINUX
-#endif
-
+// registers are spilled into a jmp_buf that is scanned with the stack, so it is
+// cleared first (setjmp leaves parts such as the signal mask uninitialized)
 #if defined(GC_PLATFORM_WINDOWS)
 
 #include <setjmp.h>
@@ -34,17 +29,19 @@
 
 #define GC_GET_STACK_EXTENTS(_gc, _stack, _size) \
     jmp_buf __env; \
+    std::memset(&__env, 0, sizeof(__env)); \
     ::setjmp(__env); \
     __asm { mov _stack, esp }; \
-    _size = (uint32_t)(_gc->stack_top() - (uintptr_t)_stack);
+    _size = (uint32_t)(_gc->active_stack_top() - (uintptr_t)_stack);
 
 #elif defined(GC_PLATFORM_SPARC)
 
 #define GC_GET_STACK_EXTENTS(_gc, _stack, _size) \
     jmp_buf __env; \
+    std::memset(&__env, 0, sizeof(__env)); \
     ::setjmp(__env); \
     asm ("mov %%sp, %0":"=r" (_stack)); \
-    _size = (uint32_t)(_gc->stack_top() - (uintptr_t)_stack);
+    _size = (uint32_t)(_gc->active_stack_top() - (uintptr_t)_stack);
 
 #elif defined(GC_PLATFORM_POWERPC)
 
@@ -55,9 +52,10 @@ register void* __sp __asm__("r1");
 
 #define GC_GET_STACK_EXTENTS(_gc, _stack, _size) \
     jmp_buf __env; \
+    std::memset(&__env, 0, sizeof(__env)); \
     ::setjmp(__env); \
     _stack = (void*)__sp; \
-    _size = (uint32_t)(_gc->stack_top() - (uintptr_t)_stack);
+    _size = (uint32_t)(_gc->active_stack_top() - (uintptr_t)_stack);
 
 #else
 
@@ -66,9 +64,10 @@ register void* __sp __asm__("r1");
 
 #define GC_GET_STACK_EXTENTS(_gc, _stack, _size) \
     jmp_buf __env; \
+    std::memset(&__env, 0, sizeof(__env)); \
     ::setjmp(__env); \
     _stack = &__env; \
-    _size = (uint32_t)(_gc->stack_top() - (uintptr_t)_stack); \
+    _size = (uint32_t)(_gc->active_stack_top() - (uintptr_t)_stack); \
 
 #endif
 
@@ -85,13 +84,130 @@ namespace lutze
     static const uint32_t register_threshold = 200;
     static const uint32_t transfer_threshold = 100;
 
-    gc::gc(bool static_gc) : static_gc(static_gc), mark_token(0), register_count(0)
+    // root filter bits per registered object and minimum filter size
+    static const uint64_t filter_bits_per_object = 16;
+    static const uint64_t filter_min_bits = 4096;
+
+    // partial traces performed between full traces, which reclaim garbage
+    // among objects on unwritten pages
+    static const uint32_t full_trace_interval = 8;
+
+    // number of stack words filtered by each call to the scan kernel
+    static const size_t scan_batch = 256;
+
+    // number of filtered candidates resolved by each batched registry lookup
+    static const size_t lookup_batch = 16;
+
+    // distance below the top of the mark stack at which headers are prefetched
+    static const size_t mark_prefetch_distance = 4;
+
+    // objects traced by an incremental mark between checks of the deadline
+    static const size_t slice_check_interval = 256;
+
+    // registered objects below which marking is never split between threads
+    static const size_t parallel_mark_min_objects = 4096;
+
+    // objects destroyed by each call to collect while a lazy sweep is in
+    // progress, at least (a larger share is taken so the sweep completes
+    // within the registrations that trigger the next collection)
+    static const size_t lazy_sweep_min = 64;
+
+    // objects promoted by minor collections before a full collection is
+    // considered, so a small heap is not collected in full every few times
+    static const size_t full_collection_min_promoted = 4096;
+
+    // gc of the current thread, once retrieved
+    static GC_THREAD_LOCAL gc* current_gc = NULL;
+
+    // mark deque of the parallel mark worker running on this thread
+    static GC_THREAD_LOCAL detail::mark_deque* local_deque = NULL;
+
+    // helper threads shared by all gc instances
+    static detail::mark_pool& get_mark_pool()
+    {
+        static detail::mark_pool pool;
+        return pool;
+    }
+
+    // threads destroying released objects for all gc instances
+    static detail::finalizer_pool& get_finalizer_pool()
+    {
+        static detail::finalizer_pool pool;
+        return pool;
+    }
+
+    // index of the lowest set bit in a non-zero word
+    static inline uint32_t lowest_bit(uint64_t word)
+    {
+        #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return (uint32_t)index;
+        #else
+        return (uint32_t)__builtin_ctzll(word);
+        #endif
+    }
+
+    static inline void prefetch(const void* ptr)
+    {
+        #if defined(_MSC_VER)
+        _mm_prefetch((const char*)ptr, _MM_HINT_T0);
+        #else
+        __builtin_prefetch(ptr);
+        #endif
+    }
+
+    #if defined(GC_INCREMENTAL_STACK_SCAN)
+    // granularity of stack change detection, and minimum widening of the heap
+    // range used when building chunk summaries
+    static const size_t stack_chunk_size = 4096;
+    static const uintptr_t summary_margin = 64 * 1024 * 1024;
+    #endif
+
+    #if defined(GC_PRECISE_ROOTS)
+
+    namespace detail
+    {
+        GC_THREAD_LOCAL gc_root* root_chain = NULL;
+
+        // top of the stack the current thread is running on
+        static GC_THREAD_LOCAL uintptr_t root_stack_top = 0;
+
+        BOOST_NOINLINE bool is_stack_address(const void* ptr)
+        {
+            // addresses between this frame and the stack top belong to callers
+            uint8_t marker = 0;
+            if (root_stack_top == 0)
+                root_stack_top = gc::query_stack_top();
+            return (uintptr_t)ptr > (uintptr_t)&marker && (uintptr_t)ptr < root_stack_top;
+        }
+    }
+
+    #endif
+
+    namespace detail
     {
+        boost::atomic<uint32_t> write_barrier_users(0);
+
+        void barrier_object(const void* slot, const gc_object* pobj)
+        {
+            gc::barrier(slot, pobj);
+        }
+
+        void destroy_object(const gc_object* pobj)
+        {
+            gc::destroy_object(pobj);
+        }
     }
 
-    gc::~gc()
+    gc::gc(bool static_gc) : sweep_quota(0), parallel_marking(false), static_gc(static_gc), gc_id(0), mark_token(0), register_count(0),
+        heap_min(~(uintptr_t)0), heap_max(0), filter_stale(0), tracker(NULL), full_trace_countdown(0), partial_trace(false),
+        incremental_marking(false), slice_budget(0), shading(false), generational(false), minor_marking(false), promoted_count(0), retained_count(0),
+        async_marking(false), cached_stack_top(0), active_stack(NULL), no_scan_changed(false)
+        #if defined(GC_INCREMENTAL_STACK_SCAN)
+        , summary_top(NULL), summary_min(~(uintptr_t)0), summary_max(0)
+        #endif
     {
-        final_collect();
     }
 
     std::string gc::gc_version()
@@ -109,33 +225,76 @@ namespace lutze
 
     void gc::gc_term()
     {
+        get_mark_pool().resize(0);
+        get_finalizer_pool().resize(0);
         unregister_gc(&get_static_gc());
     }
 
+    void gc::set_mark_threads(uint32_t helpers)
+    {
+        get_mark_pool().resize(helpers);
+    }
+
+    void gc::set_finalizer_threads(uint32_t threads)
+    {
+        get_finalizer_pool().resize(threads);
+    }
+
+    void gc::flush_finalizers()
+    {
+        get_finalizer_pool().flush();
+    }
+
     void gc::register_gc(gc* pgc)
     {
         boost::mutex::scoped_lock lock(gc_registry_mutex);
         if (!gc_init())
             boost::throw_exception(std::runtime_error("gc_init() must be called"));
-        gc_registry.insert(pgc);
+
+        // reuse the lowest id released by a terminated thread
+        pgc->gc_id = (uint32_t)(std::find(gc_registry.begin(), gc_registry.end(), (gc*)NULL) - gc_registry.begin());
+        if (pgc->gc_id == gc_registry.size())
+            gc_registry.push_back(NULL);
+        else
+            recycle_gc_id(pgc->gc_id);
+        if (pgc->gc_id / 64 >= gc_running.size())
+            gc_running.push_back(0);
+        gc_registry[pgc->gc_id] = pgc;
+        gc_running[pgc->gc_id / 64] |= (uint64_t)1 << (pgc->gc_id % 64);
     }
 
     void gc::unregister_gc(gc* pgc)
     {
+        uint32_t gc_id = pgc->gc_id;
         {
             boost::mutex::scoped_lock lock(gc_registry_mutex);
-            gc_registry.erase(pgc);
+            gc_running[gc_id / 64] &= ~((uint64_t)1 << (gc_id % 64));
+        }
+        if (current_gc == pgc)
+            current_gc = NULL;
+        pgc->final_collect();
+
+        // the id is only reused once the final collection has recorded it,
+        // and every gc left in the registry can still take transfers
+        {
+            boost::mutex::scoped_lock lock(gc_registry_mutex);
+            gc_registry[gc_id] = NULL;
         }
         delete pgc;
     }
 
     gc& gc::get_gc()
     {
+        // the shared pools are constructed first so they outlive the gc of the
+        // main thread, which is only released as thread_gc is destroyed at exit
+        static bool pools_constructed = (get_mark_pool(), get_finalizer_pool(), true);
+        (void)pools_constructed;
         static boost::thread_specific_ptr<gc> thread_gc(gc::unregister_gc);
         if (thread_gc.get() == NULL)
         {
             thread_gc.reset(new gc);
             gc::register_gc(thread_gc.get());
+            current_gc = thread_gc.get();
         }
         return *thread_gc.get();
     }
@@ -155,16 +314,57 @@ namespace lutze
     {
         BOOST_ASSERT(!static_gc);
 
+        // objects released by earlier collections are destroyed a share at a
+        // time, or all at once before a forced collection
+        if (force)
+            finish_sweep();
+        else
+            resume_sweep();
+
+        // a concurrent collection is waited for only when forced, and is then
+        // followed by a full one, since objects allocated meanwhile survive it
+        if (async_marking && (!finish_async(force) || !force))
+            return;
+
+        // minor collections are performed between full ones, which are then
+        // single pause or incremental
+        if (!force && generational && !incremental_marking)
+        {
+            if (!check_threshold())
+                return;
+            if (!full_collection_due())
+            {
+                collect_nursery();
+                return;
+            }
+        }
+
+        // incremental collections advance by a slice at a time unless forced
+        if (!force && (slice_budget != 0 || incremental_marking))
+        {
+            if (slice_budget != 0)
+                collect_slice(slice_budget);
+            return;
+        }
+
+        // objects allocated while marking incrementally survive that
+        // collection, so a forced collection follows it with a full one
+        if (incremental_marking)
+            finish_incremental(force);
+
         // have we reached threshold before collection is necessary?
         if (!force && !check_threshold())
             return;
 
+        ++statistics.collections;
+        promote_nursery();
+
         // 1) prepare release queue
         init_collect();
 
         // 2) compile set of root objects to begin marking
-        node_map roots;
         find_roots(roots);
+        find_changed_objects(roots);
 
         // 3) mark phase
         mark_objects(roots);
@@ -172,14 +372,22 @@ namespace lutze
         // 4) sweep phase
         sweep_objects();
 
-        // 5) destroy or transfer released objects
-        dispose_objects();
+        // 5) transfer released objects, destroying them later unless forced
+        dispose_objects(false, force ? NULL : this);
 
-        get_static_gc().static_collect(force);
+        reset_page_tracker();
+
+        get_static_gc().static_collect(force, force ? NULL : this);
+
+        // slabs emptied by objects destroyed since the last collection
+        trim_heap();
     }
 
-    void gc::static_collect(bool force)
+    void gc::static_collect(bool force, gc* sweeper)
     {
+        // every thread collects the static gc after its own collection
+        boost::mutex::scoped_lock lock(static_mutex);
+
         // have we reached threshold before collection is necessary?
         if (!force && !check_threshold())
             return;
@@ -188,18 +396,246 @@ namespace lutze
         init_collect();
 
         // 2) all static objects are considered roots
-        node_map roots;
-        roots.insert(object_registry.begin(), object_registry.end());
+        roots.clear();
+        for (detail::page_map::const_iterator rec = object_registry.begin(), last = object_registry.end(); rec != last; ++rec)
+            roots.push_back(rec->object);
 
         // 3) mark phase
         mark_objects(roots);
 
+        // 5) destroy or transfer released objects
+        dispose_objects(false, sweeper);
+    }
+
+    bool gc::collect_slice(uint32_t budget_us, bool force)
+    {
+        BOOST_ASSERT(!static_gc);
+
+        if (async_marking && !finish_async(force))
+            return true;
+
+        if (!incremental_marking)
+        {
+            // have we reached threshold before collection is necessary?
+            if (!force && !check_threshold())
+                return false;
+            begin_incremental();
+        }
+
+        if (!mark_slice(budget_us))
+            return true;
+        finish_incremental(force);
+        return false;
+    }
+
+    void gc::set_slice_budget(uint32_t budget_us)
+    {
+        slice_budget = budget_us;
+    }
+
+    void gc::set_generational(bool enabled)
+    {
+        BOOST_ASSERT(!static_gc || !enabled);
+
+        if (enabled == generational)
+            return;
+        if (async_marking)
+            finish_async(true);
+        generational = enabled;
+        if (enabled)
+            ++detail::write_barrier_users;
+        else
+        {
+            promote_nursery();
+            --detail::write_barrier_users;
+        }
+    }
+
+    void gc::collect_nursery()
+    {
+        BOOST_ASSERT(!static_gc);
+
+        // the registry belongs to an incremental or concurrent mark until
+        // it finishes, and includes any nursery objects
+        if (async_marking || incremental_marking)
+            return;
+
+        ++statistics.minor_collections;
+        register_count = 0;
+        if (++mark_token == 0)
+            ++mark_token;
+
+        // 1) compile set of root objects, of which only young ones are traced
+        find_roots(roots);
+        minor_marking = true;
+        queue_roots(roots);
+
+        // 2) young objects stored in old objects since the previous collection
+        // are reached by tracing those old objects, and any stored in other
+        // storage (such as a container's elements) are conservatively roots
+        {
+            boost::mutex::scoped_lock lock(shade_mutex);
+            taken_stores.swap(remembered_stores);
+        }
+        for (store_list::const_iterator store = taken_stores.begin(), last = taken_stores.end(); store != last; ++store)
+        {
+            const gc_object* pobj = store->second;
+            if (pobj->header.owner.load(boost::memory_order_relaxed) != this || !pobj->header.young)
+                continue;
+            const gc_record* holder = object_registry.find(store->first);
+            if (holder == NULL)
+                mark_stack.push_back(pobj);
+            else if (!holder->object->header.young)
+            {
+                uint32_t& mark = object_registry.mark(holder->object->header.index);
+                if (mark != mark_token)
+                {
+                    mark = mark_token;
+                    ++statistics.objects_traced;
+                    holder->object->mark_members(this);
+                }
+            }
+        }
+        taken_stores.clear();
+
+        // 3) mark phase, which never traces old objects
+        drain_mark_stack();
+        minor_marking = false;
+
+        // 4) sweep phase, promoting survivors so they are old
+        size_t promoted = 0;
+        for (object_list::const_iterator pobj = nursery.begin(), last = nursery.end(); pobj != last; ++pobj)
+        {
+            (*pobj)->header.young = false;
+            if (object_registry.mark((*pobj)->header.index) == mark_token)
+                ++promoted;
+            else
+            {
+                unregister_object(*pobj);
+                release_queue.push_back(*pobj);
+            }
+        }
+        nursery.clear();
+        promoted_count += promoted;
+        statistics.objects_promoted += promoted;
+
+        // 5) transfer released objects, destroying them later
+        dispose_objects(false, this);
+
+        get_static_gc().static_collect(false, this);
+    }
+
+    struct gc::async_state
+    {
+        async_state() : finished(false)
+        {
+        }
+
+        boost::atomic<bool> finished;
+        boost::mutex mutex;
+        boost::condition_variable finished_changed;
+    };
+
+    gc::collect_handle::collect_handle()
+    {
+    }
+
+    gc::collect_handle::collect_handle(const boost::shared_ptr<async_state>& status) : status(status)
+    {
+    }
+
+    bool gc::collect_handle::done() const
+    {
+        return !status || status->finished.load();
+    }
+
+    void gc::collect_handle::wait() const
+    {
+        if (!status)
+            return;
+        boost::mutex::scoped_lock lock(status->mutex);
+        while (!status->finished.load())
+            status->finished_changed.wait(lock);
+    }
+
+    gc::collect_handle gc::collect_async()
+    {
+        BOOST_ASSERT(!static_gc);
+
+        if (async_marking && !finish_async(false))
+            return collect_handle(async_status);
+        if (incremental_marking)
+        {
+            finish_incremental(false);
+            return collect_handle();
+        }
+
+        ++statistics.collections;
+        promote_nursery();
+
+        // 1) prepare release queue
+        init_collect();
+
+        // 2) compile set of root objects to begin marking, which are not
+        // rescanned since objects removed from any reachable object while
+        // marking are shaded (snapshot at the beginning)
+        find_roots(roots);
+        find_changed_objects(roots);
+        queue_roots(roots);
+        begin_shading();
+
+        // 3) mark, sweep and dispose on the background thread
+        async_marking = true;
+        async_status.reset(new async_state);
+        async_thread = boost::thread(boost::bind(&gc::mark_async, this));
+        return collect_handle(async_status);
+    }
+
+    void gc::mark_async()
+    {
+        // 3) mark phase
+        drain_mark_stack();
+        drain_shaded_objects();
+
+        // 4) sweep phase
+        sweep_objects();
+
         // 5) destroy or transfer released objects
         dispose_objects();
+
+        reset_page_tracker();
+
+        boost::mutex::scoped_lock lock(async_status->mutex);
+        async_status->finished = true;
+        async_status->finished_changed.notify_all();
+    }
+
+    bool gc::finish_async(bool wait)
+    {
+        if (!wait && !async_status->finished.load())
+            return false;
+        async_thread.join();
+        async_marking = false;
+        async_status.reset();
+
+        for (object_list::const_iterator pobj = pending_objects.begin(), last = pending_objects.end(); pobj != last; ++pobj)
+            insert_object(*pobj, (uintptr_t)*pobj - (*pobj)->header.offset);
+        statistics.objects_deferred += pending_objects.size();
+        pending_objects.clear();
+
+        get_static_gc().static_collect(false, this);
+        return true;
     }
 
     void gc::final_collect()
     {
+        finish_sweep();
+        if (async_marking)
+            finish_async(true);
+        if (incremental_marking)
+            abandon_incremental();
+        set_generational(false);
+
         // 1) prepare release queue
         init_collect();
 
@@ -212,7 +648,7 @@ namespace lutze
 
     #if defined(GC_PLATFORM_WINDOWS)
 
-    uintptr_t gc::stack_top() const
+    uintptr_t gc::query_stack_top()
     {
         MEMORY_BASIC_INFORMATION mbi;
         VirtualQuery(&mbi, &mbi, sizeof(MEMORY_BASIC_INFORMATION));
@@ -228,7 +664,7 @@ namespace lutze
 
     #elif defined(GC_PLATFORM_SOLARIS)
 
-    uintptr_t gc::stack_top() const
+    uintptr_t gc::query_stack_top()
     {
         #if defined(GC_PLATFORM_SPARC)
         asm("ta 3");
@@ -246,7 +682,7 @@ namespace lutze
 
     #elif defined(GC_PLATFORM_LINUX)
 
-    uintptr_t gc::stack_top() const
+    uintptr_t gc::query_stack_top()
     {
         pthread_attr_t attr;
         pthread_attr_init(&attr);
@@ -263,14 +699,14 @@ namespace lutze
 
     #elif defined(GC_PLATFORM_MAC)
 
-    uintptr_t gc::stack_top() const
+    uintptr_t gc::query_stack_top()
     {
         return (uintptr_t)pthread_get_stackaddr_np(pthread_self());
     }
 
     #else
 
-    uintptr_t gc::stack_top() const
+    uintptr_t gc::query_stack_top()
     {
         pthread_attr_t attr;
         pthread_getattr_np(pthread_self(), &attr);
@@ -284,6 +720,45 @@ namespace lutze
 
     #endif
 
+    uintptr_t gc::stack_top()
+    {
+        // stack bounds never change for the lifetime of a thread
+        if (cached_stack_top == 0)
+            cached_stack_top = query_stack_top();
+        return cached_stack_top;
+    }
+
+    bool gc::full_collection_due()
+    {
+        // transferred objects are only adopted or disposed of by a full
+        // collection
+        {
+            boost::mutex::scoped_lock lock(transfer_mutex);
+            if (transfer_queue.size() > transfer_threshold)
+                return true;
+        }
+        return promoted_count > std::max(retained_count, full_collection_min_promoted);
+    }
+
+    void gc::promote_nursery()
+    {
+        for (object_list::const_iterator pobj = nursery.begin(), last = nursery.end(); pobj != last; ++pobj)
+            (*pobj)->header.young = false;
+        nursery.clear();
+        boost::mutex::scoped_lock lock(shade_mutex);
+        remembered_stores.clear();
+    }
+
+    BOOST_NOINLINE bool gc::on_thread_stack(const void* ptr)
+    {
+        // addresses between this frame and the stack top belong to callers,
+        // while an alternate stack is active any address may be a heap one
+        uint8_t marker = 0;
+        gc* current = current_gc;
+        return current != NULL && current->active_stack == NULL &&
+               (uintptr_t)ptr > (uintptr_t)&marker && (uintptr_t)ptr < current->stack_top();
+    }
+
     bool gc::check_threshold()
     {
         if (register_count > register_threshold)
@@ -299,130 +774,1000 @@ namespace lutze
     void gc::init_collect()
     {
         register_count = 0;
-        ++mark_token;
 
-        // take snapshot of transfer queue
+        // a zero mark word identifies objects registered since the previous collection
+        if (++mark_token == 0)
+            ++mark_token;
+
+        // take snapshot of transfer queue, whose objects no longer carry the
+        // bits of ids recycled so far
         {
             boost::mutex::scoped_lock lock(transfer_mutex);
             release_queue.clear();
             release_queue.swap(transfer_queue);
+            recycled_ids.clear();
         }
+
+        // transferred objects belong to this gc until adopted or disposed
+        for (object_list::const_iterator pobj = release_queue.begin(), last = release_queue.end(); pobj != last; ++pobj)
+            (*pobj)->header.owner.store(this, boost::memory_order_relaxed);
+    }
+
+    void gc::rebuild_filter()
+    {
+        uint64_t filter_bits = filter_min_bits;
+        while (filter_bits < object_registry.size() * filter_bits_per_object)
+            filter_bits <<= 1;
+
+        filter.bits.assign((size_t)(filter_bits >> 6), 0);
+        filter.mask = filter_bits - 1;
+        filter_stale = 0;
+        heap_min = ~(uintptr_t)0;
+        heap_max = 0;
+
+        for (detail::page_map::const_iterator rec = object_registry.begin(), last = object_registry.end(); rec != last; ++rec)
+            track_object(rec->start, rec->size);
     }
 
-    void gc::find_roots(node_map& roots)
+    void gc::find_roots(object_list& roots)
     {
+        // rebuild prefilter when stale entries or growth would degrade it
+        uint64_t registry_size = object_registry.size();
+        if (filter.mask == 0 || filter_stale > registry_size / 2 || registry_size * filter_bits_per_object > (filter.mask + 1) * 2)
+            rebuild_filter();
+
+        statistics.last_scan_bytes = 0;
+        statistics.last_scan_bytes_skipped = 0;
+
+        candidates.clear();
+        roots.clear();
+
+        #if defined(GC_PRECISE_ROOTS)
+
+        // walk the thread's chain of gc_ptr instances with automatic storage
+        for (const detail::gc_root* root = detail::root_chain; root != NULL; root = root->next)
+        {
+            ++statistics.scan_candidates;
+            candidates.push_back((uintptr_t)*root->slot);
+        }
+
+        // registered frames are not on any stack, so are still scanned in full
+        scan_exclusions.clear();
+        for (extent_map::const_iterator extent = stack_extents.begin(), end = stack_extents.end(); extent != end; ++extent)
+        {
+            if (extent->second.suspended == NULL && &extent->second != active_stack)
+                scan_suspended_stack(extent->second);
+        }
+
+        #else
+
         void* stack;
         size_t stack_size;
         GC_GET_STACK_EXTENTS(this, stack, stack_size);
 
-        uint8_t* ptr = (uint8_t*)stack;
-        uint8_t* last = ptr + (stack_size - sizeof(gc_object*));
+        const uint8_t* first = (const uint8_t*)stack;
+        const uint8_t* last = first + stack_size;
 
-        // scan stack for roots
-        while (ptr < last)
+        // merge excluded regions in address order
+        scan_exclusions.assign(no_scan_regions.begin(), no_scan_regions.end());
+        std::sort(scan_exclusions.begin(), scan_exclusions.end());
+        region_list::iterator merged = scan_exclusions.begin();
+        for (region_list::const_iterator region = scan_exclusions.begin(), end = scan_exclusions.end(); region != end; ++region)
         {
-            gc_object** ppobj = reinterpret_cast<gc_object**>(ptr);
-            node_map::iterator obj = object_registry.find(normalize_ptr(*ppobj));
-            if (obj == object_registry.end())
-                ++ptr;
+            if (merged != scan_exclusions.begin() && region->first <= (merged - 1)->second)
+                (merged - 1)->second = std::max((merged - 1)->second, region->second);
             else
+                *merged++ = *region;
+        }
+        scan_exclusions.erase(merged, scan_exclusions.end());
+
+        #if defined(GC_INCREMENTAL_STACK_SCAN)
+        scan_stack_incremental(first, last);
+        #else
+        scan_stack_gaps(first, last, heap_min, heap_max, candidates);
+        #endif
+
+        // suspended stacks and registered frames are scanned in full, from the
+        // stack pointer recorded when they were last switched away from
+        if (active_stack != NULL)
+            scan_suspended_stack(thread_stack);
+        for (extent_map::const_iterator extent = stack_extents.begin(), end = stack_extents.end(); extent != end; ++extent)
+        {
+            if (&extent->second != active_stack)
+                scan_suspended_stack(extent->second);
+        }
+
+        #endif
+
+        statistics.scan_bytes += statistics.last_scan_bytes;
+        statistics.scan_bytes_skipped += statistics.last_scan_bytes_skipped;
+
+        // drop candidates rejected by the filter, keeping the rest in place
+        std::vector<uintptr_t>::iterator kept = candidates.begin();
+        for (std::vector<uintptr_t>::const_iterator word = candidates.begin(), end = candidates.end(); word != end; ++word)
+        {
+            if (maybe_object((const void*)*word))
+                *kept++ = *word;
+            else
+                ++statistics.scan_filtered;
+        }
+        candidates.erase(kept, candidates.end());
+        statistics.scan_lookups += candidates.size();
+
+        // probe the object registry a batch at a time, so the page and record
+        // loads for neighbouring candidates overlap (duplicate roots are
+        // rejected by their mark token when marking)
+        gc_record* found[lookup_batch];
+        for (size_t first = 0; first < candidates.size(); first += lookup_batch)
+        {
+            size_t count = std::min(lookup_batch, candidates.size() - first);
+            object_registry.find(&candidates[first], count, found);
+            for (size_t i = 0; i < count; ++i)
             {
-                roots.insert(*obj);
-                ptr += sizeof(gc_object*);
+                if (found[i] != NULL)
+                    roots.push_back(found[i]->object);
             }
         }
     }
 
-    void gc::mark_objects(const node_map& roots)
+    void gc::scan_stack_gaps(const uint8_t* first, const uint8_t* last, uintptr_t scan_min, uintptr_t scan_max, std::vector<uintptr_t>& found)
+    {
+        // scan around any excluded regions between first and last
+        const uint8_t* ptr = first;
+        for (region_list::const_iterator region = scan_exclusions.begin(), end = scan_exclusions.end(); region != end && region->first < last; ++region)
+        {
+            if (region->second <= ptr)
+                continue;
+            if (region->first > ptr)
+                scan_stack_range(ptr, region->first, scan_min, scan_max, found);
+            ptr = region->second;
+        }
+        if (ptr < last)
+            scan_stack_range(ptr, last, scan_min, scan_max, found);
+    }
+
+    void gc::scan_suspended_stack(const stack_extent& extent)
     {
-        for (node_map::const_iterator node = roots.begin(), last = roots.end(); node != last; ++node)
+        scan_stack_gaps(extent.suspended != NULL ? extent.suspended : extent.first, extent.last, heap_min, heap_max, candidates);
+        if (extent.suspended != NULL)
         {
-            if (unmark_objects.find(node->first) == unmark_objects.end())
-                mark_object(node->second.object);
+            const uint8_t* registers = (const uint8_t*)&extent.registers;
+            scan_stack_range(registers, registers + sizeof(extent.registers), heap_min, heap_max, candidates);
+        }
+    }
+
+    bool gc::is_excluded(const uint8_t* first, const uint8_t* last) const
+    {
+        for (region_list::const_iterator region = scan_exclusions.begin(), end = scan_exclusions.end(); region != end && region->first <= first; ++region)
+        {
+            if (region->second >= last)
+                return true;
+        }
+        return false;
+    }
+
+    void gc::register_stack(const void* ptr, size_t size)
+    {
+        stack_extent& extent = stack_extents[(const uint8_t*)ptr];
+        extent.first = (const uint8_t*)ptr;
+        extent.last = (const uint8_t*)ptr + size;
+        extent.suspended = NULL;
+    }
+
+    void gc::unregister_stack(const void* ptr)
+    {
+        BOOST_ASSERT(active_stack == NULL || active_stack->first != ptr);
+        stack_extents.erase((const uint8_t*)ptr);
+    }
+
+    void gc::switch_stack(const void* ptr)
+    {
+        // record stack pointer and registers of the stack being suspended
+        void* stack;
+        size_t stack_size;
+        GC_GET_STACK_EXTENTS(this, stack, stack_size);
+
+        stack_extent* current = &thread_stack;
+        if (active_stack != NULL)
+            current = active_stack;
+        else
+            thread_stack.last = (const uint8_t*)stack + stack_size;
+        current->suspended = (const uint8_t*)stack;
+        std::memcpy(&current->registers, &__env, sizeof(current->registers));
+
+        active_stack = ptr == NULL ? NULL : find_stack(ptr);
+        BOOST_ASSERT(ptr == NULL || active_stack != NULL);
+
+        #if defined(GC_PRECISE_ROOTS)
+        detail::root_stack_top = active_stack_top();
+        #endif
+    }
+
+    gc::stack_extent* gc::find_stack(const void* ptr)
+    {
+        extent_map::iterator extent = stack_extents.find((const uint8_t*)ptr);
+        return extent == stack_extents.end() ? NULL : &extent->second;
+    }
+
+    uintptr_t gc::active_stack_top()
+    {
+        return active_stack == NULL ? stack_top() : (uintptr_t)active_stack->last;
+    }
+
+    void gc::push_no_scan_region(const uint8_t* first, const uint8_t* last)
+    {
+        no_scan_regions.push_back(stack_region(first, last));
+        no_scan_changed = true;
+    }
+
+    void gc::pop_no_scan_region(const uint8_t* first, const uint8_t* last)
+    {
+        // guards normally unwind in reverse order, so search from the back
+        for (region_list::iterator region = no_scan_regions.end(); region != no_scan_regions.begin(); --region)
+        {
+            if ((region - 1)->first == first && (region - 1)->second == last)
+            {
+                no_scan_regions.erase(region - 1);
+                no_scan_changed = true;
+                return;
+            }
+        }
+    }
+
+    void gc::scan_stack_range(const uint8_t* first, const uint8_t* last, uintptr_t scan_min, uintptr_t scan_max, std::vector<uintptr_t>& found)
+    {
+        statistics.last_scan_bytes += last - first;
+
+        #if defined(GC_ALIGNED_STACK_SCAN)
+
+        // only pointer-aligned words can hold a gc_ptr
+        const uintptr_t align = sizeof(gc_object*) - 1;
+        const uintptr_t* ptr = (const uintptr_t*)(((uintptr_t)first + align) & ~align);
+        const uintptr_t* end = (const uintptr_t*)((uintptr_t)last & ~align);
+        if (ptr >= end)
+            return;
+
+        statistics.scan_candidates += end - ptr;
+
+        // filter a batch at a time, using the vector kernel to discard words
+        // outside the given address range
+        detail::scan_kernel scan_words = detail::get_scan_kernel();
+        while (ptr < end)
+        {
+            size_t count = std::min((size_t)(end - ptr), scan_batch);
+            size_t offset = found.size();
+            found.resize(offset + count);
+            size_t kept = scan_words(ptr, count, scan_min, scan_max, &found[offset]);
+            found.resize(offset + kept);
+            statistics.scan_filtered += count - kept;
+            ptr += count;
+        }
+
+        #else
+
+        // advance one byte at a time to allow for gc_ptr instances that are
+        // not pointer-aligned, without reading beyond the end of the range
+        if (last - first < (ptrdiff_t)sizeof(gc_object*))
+            return;
+        const uint8_t* end = last - sizeof(gc_object*);
+        for (const uint8_t* ptr = first; ptr <= end; ++ptr)
+        {
+            ++statistics.scan_candidates;
+            uintptr_t word;
+            std::memcpy(&word, ptr, sizeof(word));
+            if (word < scan_min || word > scan_max)
+                ++statistics.scan_filtered;
+            else
+                found.push_back(word);
+        }
+
+        #endif
+    }
+
+    #if defined(GC_INCREMENTAL_STACK_SCAN)
+
+    void gc::scan_stack_incremental(const uint8_t* first, const uint8_t* last)
+    {
+        // chunk summaries are built using a widened heap range so they remain
+        // valid while the heap grows, and are discarded when it outgrows them,
+        // when the excluded regions change or when another stack is active
+        if (no_scan_changed || last != summary_top || heap_min < summary_min || heap_max > summary_max)
+        {
+            no_scan_changed = false;
+            summary_top = last;
+            uintptr_t margin = std::max(heap_max - heap_min, summary_margin);
+            summary_min = heap_min > margin ? heap_min - margin : 0;
+            summary_max = heap_max < ~(uintptr_t)0 - margin ? heap_max + margin : ~(uintptr_t)0;
+            stack_summary.clear();
+        }
+
+        // chunks are counted down from the stack top so their boundaries stay
+        // fixed, and any chunk identical to its shadow copy yields the same
+        // candidates as the previous collection
+        size_t chunks = (last - first) / stack_chunk_size;
+        size_t reused = 0;
+        while (reused < chunks && reused < stack_summary.size())
+        {
+            const uint8_t* chunk_first = last - (reused + 1) * stack_chunk_size;
+            if (!is_excluded(chunk_first, chunk_first + stack_chunk_size) &&
+                std::memcmp(chunk_first, &stack_shadow[reused * stack_chunk_size], stack_chunk_size) != 0)
+                break;
+            candidates.insert(candidates.end(), stack_summary[reused].begin(), stack_summary[reused].end());
+            statistics.scan_candidates += stack_summary[reused].size();
+            ++reused;
+        }
+        statistics.last_scan_bytes_skipped += reused * stack_chunk_size;
+
+        // rescan every chunk below the watermark of the first changed chunk
+        stack_summary.resize(chunks);
+        stack_shadow.resize(chunks * stack_chunk_size);
+        for (size_t chunk = reused; chunk < chunks; ++chunk)
+        {
+            const uint8_t* chunk_first = last - (chunk + 1) * stack_chunk_size;
+            #if defined(GC_ALIGNED_STACK_SCAN)
+            const uint8_t* chunk_last = chunk_first + stack_chunk_size;
+            #else
+            // byte offsets may straddle into the chunk above, but never the top
+            const uint8_t* chunk_last = chunk == 0 ? last : chunk_first + stack_chunk_size + sizeof(gc_object*) - 1;
+            #endif
+            std::vector<uintptr_t>& summary = stack_summary[chunk];
+            summary.clear();
+            scan_stack_gaps(chunk_first, chunk_last, summary_min, summary_max, summary);
+            if (!is_excluded(chunk_first, chunk_first + stack_chunk_size))
+                std::memcpy(&stack_shadow[chunk * stack_chunk_size], chunk_first, stack_chunk_size);
+            candidates.insert(candidates.end(), summary.begin(), summary.end());
+        }
+
+        // the partial chunk nearest the stack pointer is always rescanned
+        const uint8_t* partial_last = last - chunks * stack_chunk_size;
+        #if !defined(GC_ALIGNED_STACK_SCAN)
+        if (chunks > 0)
+            partial_last += sizeof(gc_object*) - 1;
+        #endif
+        scan_stack_gaps(first, partial_last, summary_min, summary_max, candidates);
+    }
+
+    #endif
+
+    void gc::set_page_tracker(page_tracker* tracker)
+    {
+        this->tracker = tracker;
+        full_trace_countdown = 0;
+    }
+
+    void gc::find_changed_objects(object_list& roots)
+    {
+        // transferred objects may only be reachable from unchanged objects, so
+        // their adoption requires a full trace
+        if (tracker == NULL || full_trace_countdown == 0 || !release_queue.empty() || !tracker->begin())
+            return;
+
+        --full_trace_countdown;
+        partial_trace = true;
+
+        // members of an object on an unwritten page are those marked by the
+        // previous collection, so the object and its members remain reachable
+        // and it is marked without being traced
+        for (uint32_t index = 1; index <= object_registry.size(); ++index)
+        {
+            uint32_t& mark = object_registry.mark(index);
+            if (mark == 0) // registered since the previous collection
+                continue;
+            const gc_record& rec = object_registry[index];
+            if ((rec.flags & record_inline) != 0 && !tracker->written((const void*)rec.start, rec.size))
+            {
+                mark = mark_token;
+                ++statistics.objects_unchanged;
+            }
+            else
+                roots.push_back(rec.object);
+        }
+    }
+
+    void gc::reset_page_tracker()
+    {
+        if (tracker == NULL)
+            return;
+        if (!partial_trace)
+            full_trace_countdown = full_trace_interval;
+        if (!tracker->reset())
+            full_trace_countdown = 0;
+        partial_trace = false;
+    }
+
+    void gc::mark_objects(const object_list& roots)
+    {
+        std::sort(unmark_objects.begin(), unmark_objects.end());
+        if (object_registry.size() < parallel_mark_min_objects || !mark_parallel(roots))
+        {
+            for (object_list::const_iterator root = roots.begin(), last = roots.end(); root != last; ++root)
+            {
+                if (unmark_objects.empty() || !std::binary_search(unmark_objects.begin(), unmark_objects.end(), *root))
+                {
+                    mark_object(*root);
+                    drain_mark_stack();
+                }
+            }
         }
         unmark_objects.clear();
     }
 
-    void gc::mark_object(const gc_object* pobj)
+    struct gc::parallel_mark
     {
-        if (!pobj)
+        parallel_mark(const object_list& roots) : roots(roots), busy(0), traced(0)
+        {
+        }
+
+        const object_list& roots;
+        boost::atomic<uint32_t> busy; // workers that may still queue objects
+        boost::atomic<uint64_t> traced;
+        boost::mutex adopt_mutex;
+    };
+
+    bool gc::mark_parallel(const object_list& roots)
+    {
+        parallel_mark state(roots);
+        parallel_marking = true;
+        bool marked = get_mark_pool().run(boost::bind(&gc::mark_worker, this, &state, boost::placeholders::_1, boost::placeholders::_2));
+        parallel_marking = false;
+        if (!marked)
+            return false;
+        statistics.objects_traced += state.traced.load();
+
+        // adopting transferred objects updates the registry, so is left until
+        // the workers have finished
+        for (object_list::const_iterator pobj = adopt_objects.begin(), last = adopt_objects.end(); pobj != last; ++pobj)
+        {
+            mark_object(*pobj);
+            drain_mark_stack();
+        }
+        adopt_objects.clear();
+        return true;
+    }
+
+    void gc::mark_worker(parallel_mark* state, uint32_t worker, uint32_t workers)
+    {
+        detail::mark_pool& pool = get_mark_pool();
+        detail::mark_deque& deque = pool.deque(worker);
+        local_deque = &deque;
+
+        // a worker that finds every other worker idle may stop before the
+        // rest have started, which is safe since each empties its own deque
+        state->busy.fetch_add(1);
+        for (size_t root = worker; root < state->roots.size(); root += workers)
+        {
+            if (unmark_objects.empty() || !std::binary_search(unmark_objects.begin(), unmark_objects.end(), state->roots[root]))
+                deque.push(state->roots[root]);
+        }
+
+        uint64_t traced = 0;
+        const gc_object* pobj;
+        bool working = true;
+        while (working)
+        {
+            while (deque.take(pobj))
+                trace_shared(state, pobj, traced);
+
+            // steal from the other workers, starting with the next
+            bool stolen = false;
+            for (uint32_t other = 1; other < workers && !stolen; ++other)
+                stolen = pool.deque((worker + other) % workers).steal(pobj);
+            if (stolen)
+            {
+                trace_shared(state, pobj, traced);
+                continue;
+            }
+
+            // once idle, only workers that are still busy can queue more objects
+            state->busy.fetch_sub(1);
+            working = false;
+            while (!working && state->busy.load() != 0)
+            {
+                for (uint32_t other = 1; other < workers && !working; ++other)
+                {
+                    detail::mark_deque& victim = pool.deque((worker + other) % workers);
+                    if (victim.empty())
+                        continue;
+                    state->busy.fetch_add(1);
+                    if (victim.steal(pobj))
+                    {
+                        trace_shared(state, pobj, traced);
+                        working = true;
+                    }
+                    else
+                        state->busy.fetch_sub(1);
+                }
+                if (!working)
+                    boost::this_thread::yield();
+            }
+        }
+
+        state->traced.fetch_add(traced);
+        local_deque = NULL;
+    }
+
+    void gc::trace_shared(parallel_mark* state, const gc_object* pobj, uint64_t& traced)
+    {
+        pobj = pobj->registered_object();
+        if (pobj->header.owner.load(boost::memory_order_relaxed) != this) // object does not belong to this gc
             return;
-        void* ptr = normalize_ptr(pobj);
-        node_map::iterator node = object_registry.find(ptr);
-        if (node == object_registry.end()) // object does not belong to this gc registry
+        const gc_object::gc_header& header = pobj->header;
+        if (header.index == 0) // transferred object is still reachable
         {
-            node_map::iterator input = release_queue.find(ptr);
-            if (input == release_queue.end())
-                return;
-            node = object_registry.insert(std::make_pair(ptr, gc_node(pobj))).first;
-            release_queue.erase(input); // take ownership
+            boost::mutex::scoped_lock lock(state->adopt_mutex);
+            adopt_objects.push_back(pobj);
+            return;
+        }
+
+        // the worker that sets the mark word traces the object
+        boost::atomic_ref<uint32_t> mark(object_registry.mark(header.index));
+        uint32_t current = mark.load(boost::memory_order_relaxed);
+        if (current == mark_token || !mark.compare_exchange_strong(current, mark_token, boost::memory_order_relaxed) || header.leaf)
+            return;
+        ++traced;
+        pobj->mark_members(this);
+    }
+
+    void gc::push_shared(const gc_object* pobj)
+    {
+        local_deque->push(pobj);
+    }
+
+    void gc::drain_mark_stack(size_t budget)
+    {
+        // members are pushed rather than marked recursively, so stack usage
+        // does not grow with the depth of the object graph
+        while (!mark_stack.empty() && budget != 0)
+        {
+            const gc_object* pobj = mark_stack.back();
+            mark_stack.pop_back();
+
+            // entries just below the top are popped next
+            if (mark_stack.size() >= mark_prefetch_distance)
+                prefetch(mark_stack[mark_stack.size() - mark_prefetch_distance]);
+
+            pobj = pobj->registered_object();
+            if (pobj->header.owner.load(boost::memory_order_relaxed) != this) // object does not belong to this gc
+                continue;
+            gc_object::gc_header& header = pobj->header;
+            if (minor_marking && !header.young) // old objects are only traced by a full collection
+                continue;
+            if (header.index == 0) // transferred object is still reachable, take ownership
+            {
+                insert_object(pobj, (uintptr_t)pobj - header.offset);
+                header.history = 0;
+                delete header.history_overflow;
+                header.history_overflow = NULL;
+            }
+            uint32_t& mark = object_registry.mark(header.index);
+            if (mark != mark_token)
+            {
+                mark = mark_token;
+                --budget;
+                if (header.leaf)
+                    continue;
+                ++statistics.objects_traced;
+
+                // pop members in the order they were marked, which is usually
+                // the order they were allocated in
+                size_t pushed = mark_stack.size();
+                pobj->mark_members(this);
+                std::reverse(mark_stack.begin() + pushed, mark_stack.end());
+            }
+        }
+    }
+
+    void gc::queue_roots(const object_list& roots)
+    {
+        std::sort(unmark_objects.begin(), unmark_objects.end());
+        for (object_list::const_iterator root = roots.begin(), last = roots.end(); root != last; ++root)
+        {
+            if (unmark_objects.empty() || !std::binary_search(unmark_objects.begin(), unmark_objects.end(), *root))
+                mark_stack.push_back(*root);
+        }
+        unmark_objects.clear();
+    }
+
+    void gc::begin_shading()
+    {
+        {
+            boost::mutex::scoped_lock lock(shade_mutex);
+            shading = true;
+        }
+        ++detail::write_barrier_users;
+    }
+
+    void gc::drain_shaded_objects()
+    {
+        // shading only stops once the mark stack is empty with the lock held,
+        // so no object stored by another thread is missed
+        while (true)
+        {
+            {
+                boost::mutex::scoped_lock lock(shade_mutex);
+                if (mark_stack.empty() && shaded_objects.empty())
+                {
+                    shading = false;
+                    break;
+                }
+                mark_stack.insert(mark_stack.end(), shaded_objects.begin(), shaded_objects.end());
+                shaded_objects.clear();
+            }
+            drain_mark_stack();
         }
-        if (mark_token != node->second.mark_token)
+        --detail::write_barrier_users;
+    }
+
+    void gc::begin_incremental()
+    {
+        ++statistics.collections;
+        promote_nursery();
+
+        // 1) prepare release queue
+        init_collect();
+
+        // 2) compile set of root objects to begin marking
+        find_roots(roots);
+        find_changed_objects(roots);
+        queue_roots(roots);
+
+        // 3) mark phase, performed a slice at a time while objects stored by
+        // any thread are shaded
+        incremental_marking = true;
+        begin_shading();
+    }
+
+    bool gc::mark_slice(uint32_t budget_us)
+    {
+        ++statistics.mark_slices;
+        boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::microseconds(budget_us);
+        do
         {
-            node->second.mark_token = mark_token;
-            node->second.object->mark_members(this);
+            take_shaded_objects();
+            if (mark_stack.empty())
+                return true;
+            drain_mark_stack(slice_check_interval);
+        }
+        while (boost::posix_time::microsec_clock::universal_time() < deadline);
+        return false;
+    }
+
+    void gc::take_shaded_objects()
+    {
+        boost::mutex::scoped_lock lock(shade_mutex);
+        mark_stack.insert(mark_stack.end(), shaded_objects.begin(), shaded_objects.end());
+        shaded_objects.clear();
+    }
+
+    void gc::finish_incremental(bool force)
+    {
+        // roots are not shaded when they change, so any held now are marked
+        // in a final pause, along with any objects stored meanwhile
+        find_roots(roots);
+        mark_objects(roots);
+        drain_shaded_objects();
+        incremental_marking = false;
+
+        // 4) sweep phase
+        sweep_objects();
+
+        // 5) transfer released objects, destroying them later unless forced
+        dispose_objects(false, force ? NULL : this);
+
+        reset_page_tracker();
+
+        get_static_gc().static_collect(force, force ? NULL : this);
+
+        // slabs emptied by objects destroyed since the last collection
+        trim_heap();
+    }
+
+    void gc::abandon_incremental()
+    {
+        {
+            boost::mutex::scoped_lock lock(shade_mutex);
+            shading = false;
+            shaded_objects.clear();
+        }
+        --detail::write_barrier_users;
+        incremental_marking = false;
+        mark_stack.clear();
+        partial_trace = false;
+
+        // transferred objects not yet adopted are queued again, so they are
+        // disposed of by the collection that follows
+        boost::mutex::scoped_lock lock(transfer_mutex);
+        for (object_list::const_iterator pobj = release_queue.begin(), last = release_queue.end(); pobj != last; ++pobj)
+        {
+            if ((*pobj)->header.index == 0)
+                transfer_queue.push_back(*pobj);
+        }
+        release_queue.clear();
+    }
+
+    void gc::barrier(const void* slot, const gc_object* pobj)
+    {
+        pobj = pobj->registered_object();
+        gc* owner = pobj->header.owner.load(boost::memory_order_relaxed);
+        if (owner == NULL) // object in transit is marked by its next owner
+            return;
+
+        // stores to the stack are found by scanning it
+        bool remember = slot != NULL && pobj->header.young && !on_thread_stack(slot);
+        if (!remember && !owner->shading)
+            return;
+
+        boost::mutex::scoped_lock lock(owner->shade_mutex);
+        if (owner->shading)
+        {
+            owner->shaded_objects.push_back(pobj);
+            ++owner->statistics.objects_shaded;
+        }
+        if (remember)
+        {
+            owner->remembered_stores.push_back(std::make_pair(slot, pobj));
+            ++owner->statistics.stores_remembered;
         }
     }
 
     void gc::unmark_object(const gc_object* pobj)
     {
-        node_map::iterator node = object_registry.find(normalize_ptr(pobj));
-        if (node != object_registry.end())
-            unmark_objects.insert(*node);
+        if (pobj == NULL)
+            return;
+        // the index is not read, as a concurrent mark may be writing it; an
+        // object already released is simply never found among the roots
+        pobj = pobj->registered_object();
+        if (pobj->header.owner.load(boost::memory_order_relaxed) == this)
+            unmark_objects.push_back(pobj);
     }
 
     void gc::sweep_objects()
     {
-        for (node_map::iterator node = object_registry.begin(), last = object_registry.end(); node != last; ++node)
+        object_registry.unmarked(mark_token, unmarked_records);
+
+        // erase from the highest index, so each record moved into a hole has
+        // already been found to be marked
+        for (std::vector<uint32_t>::const_reverse_iterator index = unmarked_records.rbegin(), last = unmarked_records.rend(); index != last; ++index)
         {
-            if (node->second.mark_token != mark_token)
-                release_queue.insert(*node);
+            const gc_object* pobj = object_registry[*index].object;
+            unregister_object(pobj);
+            release_queue.push_back(pobj);
         }
+        unmarked_records.clear();
+
+        // minor collections follow until as many objects again are promoted
+        retained_count = object_registry.size();
+        promoted_count = 0;
     }
 
-    void gc::dispose_objects(bool destroy)
+    void gc::dispose_objects(bool destroy, gc* sweeper)
     {
-        boost::mutex::scoped_lock lock(gc_registry_mutex);
+        {
+            boost::mutex::scoped_lock lock(gc_registry_mutex);
 
-        // take snapshot of currently running gc set
-        gc_set gc_running(gc_registry);
-        gc_running.erase(this);
+            if (transfer_lists.size() < gc_registry.size())
+                transfer_lists.resize(gc_registry.size());
 
-        typedef boost::unordered_map<gc*, node_map> transfer_map;
-        transfer_map transfer;
+            // ids reused while collecting were visited by the previous holder
+            {
+                boost::mutex::scoped_lock lock(transfer_mutex);
+                for (std::vector<uint32_t>::const_iterator id = recycled_ids.begin(), last = recycled_ids.end(); id != last; ++id)
+                {
+                    for (object_list::const_iterator pobj = release_queue.begin(), last_obj = release_queue.end(); pobj != last_obj; ++pobj)
+                        clear_history(*pobj, *id);
+                }
+            }
 
-        // clean up phase
-        for (node_map::iterator node = release_queue.begin(), last = release_queue.end(); node != last; ++node)
-        {
-            // std::cout << "release:" << node->second.object << "\n";
-            unregister_object(node->second.object);
-            gc_set remaining;
-            std::set_difference(gc_running.begin(), gc_running.end(), node->second.history.begin(), node->second.history.end(), std::inserter(remaining, remaining.end()));
+            // clean up phase
+            for (object_list::const_iterator pobj = release_queue.begin(), last = release_queue.end(); pobj != last; ++pobj)
+            {
+                if ((*pobj)->header.index != 0) // adopted while marking
+                    continue;
+
+                // std::cout << "release:" << *pobj << "\n";
+
+                // destroy object when we're sure it doesn't belong to any other
+                // gc instance, otherwise transfer to the next unvisited gc
+                gc* target = destroy ? NULL : next_gc(*pobj);
+                if (target == NULL)
+                    destroy_list.push_back(*pobj);
+                else
+                {
+                    add_history(*pobj);
+                    (*pobj)->header.owner.store(NULL, boost::memory_order_relaxed);
+                    transfer_lists[target->gc_id].push_back(*pobj);
+                }
+            }
+            release_queue.clear();
+
+            // transfer all remaining objects to other gc instances
+            for (uint32_t target = 0; target < transfer_lists.size(); ++target)
+            {
+                if (transfer_lists[target].empty())
+                    continue;
+                gc_registry[target]->transfer(transfer_lists[target]);
+                transfer_lists[target].clear();
+            }
+        }
 
-            // destroy object when we're sure it doesn't belong to any other
-            // gc instance, otherwise transfer to first reamining gc
-            if (destroy || remaining.empty())
-                delete const_cast<gc_object*>(node->second.object);
+        // trivially destructible objects are freed at once, having no
+        // destructor to defer
+        size_t count = 0;
+        for (object_list::const_iterator pobj = destroy_list.begin(), last = destroy_list.end(); pobj != last; ++pobj)
+        {
+            if (reclaim_object(*pobj))
+                ++statistics.objects_reclaimed;
             else
+                destroy_list[count++] = *pobj;
+        }
+        destroy_list.resize(count);
+
+        // other objects are destroyed outside the registry lock, by the
+        // finalizer threads when running, otherwise later by sweeper when given
+        if (destroy_list.empty())
+            return;
+        if (get_finalizer_pool().submit(destroy_list))
+            statistics.objects_finalized += count;
+        else if (sweeper != NULL)
+        {
+            sweeper->sweep_queue.insert(sweeper->sweep_queue.end(), destroy_list.begin(), destroy_list.end());
+            sweeper->sweep_quota = std::max(lazy_sweep_min, sweeper->sweep_queue.size() / register_threshold + 1);
+        }
+        else
+        {
+            // removed before destroying, as a destructor that allocates may
+            // dispose of objects again
+            while (!destroy_list.empty())
             {
-                // append object to first remaining gc transfer map
-                node->second.history.insert(this);
-                std::pair<transfer_map::iterator, bool> transfer_gc = transfer.insert(std::make_pair(*remaining.begin(), node_map()));
-                transfer_gc.first->second.insert(*node);
+                const gc_object* pobj = destroy_list.back();
+                destroy_list.pop_back();
+                destroy_object(pobj);
+                ++statistics.objects_destroyed;
             }
         }
+        destroy_list.clear();
+    }
+
+    void gc::resume_sweep()
+    {
+        if (sweep_queue.empty())
+            return;
+        ++statistics.sweep_steps;
+
+        // each object is removed before it is destroyed, in case its
+        // destructor allocates and so collects again
+        for (size_t count = std::min(sweep_quota, sweep_queue.size()); count != 0 && !sweep_queue.empty(); --count)
+        {
+            const gc_object* pobj = sweep_queue.back();
+            sweep_queue.pop_back();
+            destroy_object(pobj);
+            ++statistics.objects_destroyed;
+        }
+        if (sweep_queue.empty())
+            trim_heap();
+    }
 
-        // transfer all remaining objects to other gc instances
-        for (transfer_map::iterator transfer_gc = transfer.begin(), last = transfer.end(); transfer_gc != last; ++transfer_gc)
-            transfer_gc->first->transfer(transfer_gc->second);
+    void gc::finish_sweep()
+    {
+        if (sweep_queue.empty())
+            return;
+        while (!sweep_queue.empty())
+        {
+            const gc_object* pobj = sweep_queue.back();
+            sweep_queue.pop_back();
+            destroy_object(pobj);
+            ++statistics.objects_destroyed;
+        }
+        trim_heap();
+    }
+
+    bool gc::reclaim_object(const gc_object* pobj)
+    {
+        gc_object::gc_header& header = pobj->header;
+        if (!header.trivial)
+            return false;
+
+        // the only state gc_object itself frees on destruction, and the
+        // registered size includes storage allocated inline after the object
+        delete header.history_overflow;
+        detail::free_object((uint8_t*)pobj - header.offset, header.size);
+        return true;
+    }
+
+    void gc::destroy_object(const gc_object* pobj)
+    {
+        // a deleting destructor frees only the size of the class, so the
+        // registered size is freed instead, including inline storage
+        const gc_object::gc_header& header = pobj->header;
+        uint8_t* start = (uint8_t*)pobj - header.offset;
+        uint32_t size = header.size;
+        const_cast<gc_object*>(pobj)->~gc_object();
+        detail::free_object(start, size);
+    }
+
+    void gc::trim_heap()
+    {
+        // the static gc has no thread, so no heap of its own
+        if (static_gc)
+            return;
+        detail::heap_usage usage = detail::trim_heap();
+        statistics.heap_bytes_reserved = usage.reserved;
+        statistics.heap_bytes_committed = usage.committed;
+        statistics.heap_bytes_released = usage.released;
+    }
+
+    gc* gc::next_gc(const gc_object* pobj) const
+    {
+        const gc_object::gc_header& header = pobj->header;
+        gc* static_target = NULL;
+        for (size_t word = 0; word < gc_running.size(); ++word)
+        {
+            // running gcs not yet visited, excluding this one
+            uint64_t remaining = gc_running[word];
+            if (word == 0)
+                remaining &= ~header.history;
+            else if (header.history_overflow != NULL && word - 1 < header.history_overflow->size())
+                remaining &= ~(*header.history_overflow)[word - 1];
+            if (word == gc_id / 64)
+                remaining &= ~((uint64_t)1 << (gc_id % 64));
+
+            for (; remaining != 0; remaining &= remaining - 1)
+            {
+                gc* target = gc_registry[word * 64 + lowest_bit(remaining)];
+                if (!target->static_gc)
+                    return target;
+                static_target = target;
+            }
+        }
+        return static_target;
+    }
+
+    void gc::add_history(const gc_object* pobj) const
+    {
+        gc_object::gc_header& header = pobj->header;
+        if (gc_id < 64)
+            header.history |= (uint64_t)1 << gc_id;
+        else
+        {
+            if (header.history_overflow == NULL)
+                header.history_overflow = new std::vector<uint64_t>;
+            if (header.history_overflow->size() < gc_id / 64)
+                header.history_overflow->resize(gc_id / 64, 0);
+            (*header.history_overflow)[gc_id / 64 - 1] |= (uint64_t)1 << (gc_id % 64);
+        }
+    }
+
+    void gc::clear_history(const gc_object* pobj, uint32_t id)
+    {
+        gc_object::gc_header& header = pobj->header;
+        if (id < 64)
+            header.history &= ~((uint64_t)1 << id);
+        else if (header.history_overflow != NULL && id / 64 - 1 < header.history_overflow->size())
+            (*header.history_overflow)[id / 64 - 1] &= ~((uint64_t)1 << (id % 64));
+    }
+
+    void gc::recycle_gc_id(uint32_t id)
+    {
+        // an id is only freed once its gc has disposed of every object, so the
+        // objects carrying its bit are queued for transfer or being collected
+        for (std::vector<gc*>::const_iterator pgc = gc_registry.begin(), last = gc_registry.end(); pgc != last; ++pgc)
+        {
+            if (*pgc == NULL)
+                continue;
+            boost::mutex::scoped_lock lock((*pgc)->transfer_mutex);
+            for (object_list::const_iterator pobj = (*pgc)->transfer_queue.begin(), last_obj = (*pgc)->transfer_queue.end(); pobj != last_obj; ++pobj)
+                clear_history(*pobj, id);
+            (*pgc)->recycled_ids.push_back(id);
+        }
     }
 
-    void gc::transfer(const node_map& transfer_nodes)
+    void gc::transfer(const object_list& transfer_objects)
     {
         boost::mutex::scoped_lock lock(transfer_mutex);
-        transfer_queue.insert(transfer_nodes.begin(), transfer_nodes.end());
+        transfer_queue.insert(transfer_queue.end(), transfer_objects.begin(), transfer_objects.end());
     }
 
     boost::mutex gc::gc_registry_mutex;
-    gc::gc_set gc::gc_registry;
+    std::vector<gc*> gc::gc_registry;
+    std::vector<uint64_t> gc::gc_running;
 }
@@ -0,0 +1,399 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc.h"
+#include "gc_allocator.h"
+#include <algorithm>
+#include <new>
+#include <boost/thread/tss.hpp>
+#include <boost/throw_exception.hpp>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+namespace lutze
+{
+    namespace detail
+    {
+        // consecutive trims a chunk must be found empty before it is released,
+        // so a chunk emptied by one collection is kept for the allocations
+        // that follow it
+        static const uint32_t chunk_decay_trims = 2;
+
+        // map an aligned chunk of address space, returning NULL on failure
+        static uint8_t* map_chunk()
+        {
+            #if defined(_WIN32) || defined(_WIN64)
+            // reserve twice the size to find an aligned address, then map
+            // just the aligned chunk there (retrying if another thread took it)
+            for (int32_t attempt = 0; attempt < 8; ++attempt)
+            {
+                uint8_t* region = (uint8_t*)::VirtualAlloc(NULL, heap_chunk::size * 2, MEM_RESERVE, PAGE_NOACCESS);
+                if (region == NULL)
+                    return NULL;
+                uint8_t* aligned = (uint8_t*)(((uintptr_t)region + heap_chunk::size - 1) & ~(uintptr_t)(heap_chunk::size - 1));
+                ::VirtualFree(region, 0, MEM_RELEASE);
+                uint8_t* base = (uint8_t*)::VirtualAlloc(aligned, heap_chunk::size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+                if (base != NULL)
+                    return base;
+            }
+            return NULL;
+            #else
+            // map twice the size and unmap the unaligned ends
+            void* region = ::mmap(NULL, heap_chunk::size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region == MAP_FAILED)
+                return NULL;
+            uint8_t* base = (uint8_t*)(((uintptr_t)region + heap_chunk::size - 1) & ~(uintptr_t)(heap_chunk::size - 1));
+            if (base != (uint8_t*)region)
+                ::munmap(region, base - (uint8_t*)region);
+            if (base + heap_chunk::size != (uint8_t*)region + heap_chunk::size * 2)
+                ::munmap(base + heap_chunk::size, (uint8_t*)region + heap_chunk::size * 2 - (base + heap_chunk::size));
+            #if defined(GC_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+            ::madvise(base, heap_chunk::size, MADV_HUGEPAGE);
+            #endif
+            return base;
+            #endif
+        }
+
+        // return the memory of an empty chunk to the operating system, keeping
+        // its address space reserved
+        static void release_chunk(uint8_t* base)
+        {
+            #if defined(_WIN32) || defined(_WIN64)
+            ::VirtualFree(base, heap_chunk::size, MEM_DECOMMIT);
+            #else
+            ::madvise(base, heap_chunk::size, MADV_DONTNEED);
+            #endif
+        }
+
+        // make a released chunk usable again, returning false on failure
+        #if defined(_WIN32) || defined(_WIN64)
+        static bool reuse_chunk(uint8_t* base)
+        {
+            return ::VirtualAlloc(base, heap_chunk::size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+        }
+        #else
+        static bool reuse_chunk(uint8_t*)
+        {
+            // released pages are faulted back in, zeroed, when next touched
+            return true;
+        }
+        #endif
+
+        // bytes reserved at the start of each slab for its header, keeping
+        // cells aligned to the granule
+        static const size_t slab_header_size = (sizeof(slab) + 63) & ~(size_t)63;
+
+        // heap owned by the current thread, once it has allocated
+        static GC_THREAD_LOCAL thread_heap* local_heap = NULL;
+
+        static void release_heap(thread_heap* heap);
+
+        // heaps released by terminated threads, waiting to be adopted
+        struct heap_pool
+        {
+            heap_pool() : exit_hook(release_heap)
+            {
+            }
+
+            boost::mutex mutex;
+            std::vector<thread_heap*> idle;
+            boost::thread_specific_ptr<thread_heap> exit_hook; // releases the heap at thread exit
+        };
+
+        // the pool is never destroyed, since objects may still be freed by
+        // static destructors
+        static heap_pool& get_heap_pool()
+        {
+            static heap_pool* pool = new heap_pool;
+            return *pool;
+        }
+
+        static void release_heap(thread_heap* heap)
+        {
+            if (local_heap == heap)
+                local_heap = NULL;
+            heap_pool& pool = get_heap_pool();
+            boost::mutex::scoped_lock lock(pool.mutex);
+            pool.idle.push_back(heap);
+        }
+
+        static thread_heap& acquire_heap()
+        {
+            heap_pool& pool = get_heap_pool();
+            {
+                boost::mutex::scoped_lock lock(pool.mutex);
+                if (pool.idle.empty())
+                    local_heap = new thread_heap;
+                else
+                {
+                    local_heap = pool.idle.back();
+                    pool.idle.pop_back();
+                }
+            }
+            pool.exit_hook.reset(local_heap);
+            return *local_heap;
+        }
+
+        static inline slab* slab_of(const void* ptr)
+        {
+            return (slab*)((uintptr_t)ptr & ~(uintptr_t)(slab::size - 1));
+        }
+
+        void* allocate_object(size_t size, uint32_t space)
+        {
+            if (size > thread_heap::max_size)
+                return ::operator new(size);
+            thread_heap& heap = local_heap == NULL ? acquire_heap() : *local_heap;
+            return heap.allocate((uint32_t)(space * thread_heap::size_classes + (size + thread_heap::granule - 1) / thread_heap::granule));
+        }
+
+        heap_usage trim_heap()
+        {
+            if (local_heap == NULL)
+                return heap_usage();
+            local_heap->trim();
+            return local_heap->usage();
+        }
+
+        void free_object(void* ptr, size_t size)
+        {
+            if (ptr == NULL)
+                return;
+            if (size > thread_heap::max_size)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+            slab* pslab = slab_of(ptr);
+            if (pslab->heap == local_heap)
+                local_heap->free(pslab, ptr);
+            else
+                thread_heap::free_remote(pslab, ptr);
+        }
+
+        thread_heap::thread_heap() : chunk_hint(0), remote_pending(false)
+        {
+            for (uint32_t size_class = 0; size_class < size_classes * heap_spaces; ++size_class)
+            {
+                classes[size_class].current = NULL;
+                classes[size_class].partial = NULL;
+            }
+        }
+
+        void* thread_heap::allocate(uint32_t size_class)
+        {
+            // zero sized objects share the smallest size class of their space
+            if (size_class % size_classes == 0)
+                ++size_class;
+            slab* pslab = classes[size_class].current;
+            if (pslab != NULL)
+            {
+                void* cell = pslab->free_cells;
+                if (cell != NULL)
+                {
+                    pslab->free_cells = *(void**)cell;
+                    ++pslab->used;
+                    return cell;
+                }
+                if (pslab->bump < pslab->limit)
+                {
+                    cell = pslab->bump;
+                    pslab->bump += pslab->cell_size;
+                    ++pslab->used;
+                    return cell;
+                }
+            }
+            return refill(size_class);
+        }
+
+        void thread_heap::free(slab* pslab, void* cell)
+        {
+            *(void**)cell = pslab->free_cells;
+            pslab->free_cells = cell;
+            --pslab->used;
+
+            // a full slab is made available again once a cell is freed
+            if (!pslab->listed)
+            {
+                size_class_slabs& slabs = classes[pslab->size_class];
+                pslab->listed = true;
+                pslab->next_partial = slabs.partial;
+                slabs.partial = pslab;
+            }
+        }
+
+        void thread_heap::free_remote(slab* pslab, void* cell)
+        {
+            void* head = pslab->remote_cells.load(boost::memory_order_relaxed);
+            do
+            {
+                *(void**)cell = head;
+            }
+            while (!pslab->remote_cells.compare_exchange_weak(head, cell, boost::memory_order_release, boost::memory_order_relaxed));
+
+            // the first cell freed since the owner last collected them lists
+            // the slab, so the owner only visits slabs with cells to collect
+            if (head != NULL)
+                return;
+            thread_heap* heap = pslab->heap;
+            boost::mutex::scoped_lock lock(heap->remote_mutex);
+            heap->remote_slabs.push_back(pslab);
+            heap->remote_pending.store(true, boost::memory_order_relaxed);
+        }
+
+        void* thread_heap::refill(uint32_t size_class)
+        {
+            size_class_slabs& slabs = classes[size_class];
+            if (slabs.current != NULL)
+            {
+                slabs.current->listed = false;
+                slabs.current = NULL;
+            }
+
+            if (slabs.partial == NULL && remote_pending.load(boost::memory_order_relaxed))
+                collect_remote();
+
+            slab* pslab = slabs.partial;
+            if (pslab != NULL)
+                slabs.partial = pslab->next_partial;
+            else
+                pslab = new_slab(size_class);
+            slabs.current = pslab;
+            return allocate(size_class);
+        }
+
+        void thread_heap::collect_remote()
+        {
+            {
+                boost::mutex::scoped_lock lock(remote_mutex);
+                taken_slabs.swap(remote_slabs);
+                remote_pending.store(false, boost::memory_order_relaxed);
+            }
+            for (std::vector<slab*>::iterator pslab = taken_slabs.begin(); pslab != taken_slabs.end(); ++pslab)
+            {
+                void* cells = (*pslab)->remote_cells.exchange(NULL, boost::memory_order_acquire);
+                while (cells != NULL)
+                {
+                    void* next = *(void**)cells;
+                    free(*pslab, cells);
+                    cells = next;
+                }
+            }
+            taken_slabs.clear();
+        }
+
+        void thread_heap::trim()
+        {
+            if (remote_pending.load(boost::memory_order_relaxed))
+                collect_remote();
+
+            // a slab with no cells in use is the current slab of its size
+            // class or on its partial list
+            for (uint32_t size_class = 0; size_class < size_classes * heap_spaces; ++size_class)
+            {
+                size_class_slabs& slabs = classes[size_class];
+                if (slabs.current != NULL && slabs.current->used == 0)
+                {
+                    free_slab(slabs.current);
+                    slabs.current = NULL;
+                }
+                for (slab** link = &slabs.partial; *link != NULL;)
+                {
+                    slab* pslab = *link;
+                    if (pslab->used != 0)
+                        link = &pslab->next_partial;
+                    else
+                    {
+                        *link = pslab->next_partial;
+                        free_slab(pslab);
+                    }
+                }
+            }
+
+            for (std::vector<heap_chunk*>::iterator chunk = chunks.begin(); chunk != chunks.end(); ++chunk)
+            {
+                if ((*chunk)->released || (*chunk)->free_slabs != ~(uint32_t)0 >> (32 - heap_chunk::slabs))
+                    continue;
+                if (++(*chunk)->empty_trims < chunk_decay_trims)
+                    continue;
+                release_chunk((*chunk)->base);
+                (*chunk)->released = true;
+                bytes.released += heap_chunk::size;
+            }
+        }
+
+        const heap_usage& thread_heap::usage() const
+        {
+            return bytes;
+        }
+
+        slab* thread_heap::new_slab(uint32_t size_class)
+        {
+            while (chunk_hint < chunks.size() && chunks[chunk_hint]->free_slabs == 0)
+                ++chunk_hint;
+            if (chunk_hint == chunks.size())
+            {
+                uint8_t* base = map_chunk();
+                if (base == NULL)
+                    boost::throw_exception(std::bad_alloc());
+                heap_chunk* chunk = new heap_chunk;
+                chunk->base = base;
+                chunk->index = chunks.size();
+                chunk->free_slabs = ~(uint32_t)0 >> (32 - heap_chunk::slabs);
+                chunk->empty_trims = 0;
+                chunk->released = false;
+                chunks.push_back(chunk);
+                bytes.reserved += heap_chunk::size;
+            }
+
+            heap_chunk* chunk = chunks[chunk_hint];
+            if (chunk->released)
+            {
+                if (!reuse_chunk(chunk->base))
+                    boost::throw_exception(std::bad_alloc());
+                chunk->released = false;
+                bytes.released -= heap_chunk::size;
+            }
+            uint32_t index = 0;
+            while ((chunk->free_slabs & ((uint32_t)1 << index)) == 0)
+                ++index;
+            chunk->free_slabs &= ~((uint32_t)1 << index);
+            chunk->empty_trims = 0;
+            bytes.committed += slab::size;
+
+            void* memory = chunk->base + index * slab::size;
+            slab* pslab = new (memory) slab;
+            pslab->heap = this;
+            pslab->chunk = chunk;
+            pslab->size_class = size_class;
+            pslab->cell_size = (uint32_t)(size_class % size_classes * granule);
+            pslab->used = 0;
+            pslab->listed = true;
+            pslab->free_cells = NULL;
+            pslab->bump = (uint8_t*)memory + slab_header_size;
+            pslab->limit = (uint8_t*)memory + slab::size - pslab->cell_size + 1;
+            pslab->next_partial = NULL;
+            pslab->remote_cells.store(NULL, boost::memory_order_relaxed);
+            return pslab;
+        }
+
+        void thread_heap::free_slab(slab* pslab)
+        {
+            heap_chunk* chunk = pslab->chunk;
+            pslab->~slab();
+            chunk->free_slabs |= (uint32_t)1 << (((uint8_t*)pslab - chunk->base) / slab::size);
+            chunk_hint = std::min(chunk_hint, chunk->index);
+            bytes.committed -= slab::size;
+        }
+    }
+}
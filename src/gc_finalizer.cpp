@@ -0,0 +1,106 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc.h"
+#include "gc_finalizer.h"
+
+namespace lutze
+{
+    namespace detail
+    {
+        finalizer_pool::finalizer_pool() : submitted(0), finished(0), stopping(false)
+        {
+        }
+
+        finalizer_pool::~finalizer_pool()
+        {
+            resize(0);
+        }
+
+        void finalizer_pool::resize(uint32_t threads)
+        {
+            // the threads are only changed under the lock, as submit reads them
+            std::vector<boost::thread*> stopped;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                stopping = true;
+                stopped.swap(finalizers);
+            }
+            batch_ready.notify_all();
+            for (std::vector<boost::thread*>::iterator finalizer = stopped.begin(); finalizer != stopped.end(); ++finalizer)
+            {
+                (*finalizer)->join();
+                delete *finalizer;
+            }
+
+            boost::mutex::scoped_lock lock(mutex);
+            stopping = false;
+            for (uint32_t thread = 0; thread < threads; ++thread)
+                finalizers.push_back(new boost::thread(&finalizer_pool::finalizer_main, this));
+        }
+
+        bool finalizer_pool::submit(object_list& objects)
+        {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (finalizers.empty() || stopping)
+                    return false;
+                batches.push_back(object_list());
+                batches.back().swap(objects);
+                ++submitted;
+
+                // hand back an emptied batch so the caller keeps its capacity
+                if (!idle.empty())
+                {
+                    objects.swap(idle.back());
+                    idle.pop_back();
+                }
+            }
+            batch_ready.notify_one();
+            return true;
+        }
+
+        void finalizer_pool::flush()
+        {
+            // batches finish in any order, so this waits for those submitted
+            // meanwhile as well
+            boost::mutex::scoped_lock lock(mutex);
+            while (finished < submitted)
+                batch_done.wait(lock);
+        }
+
+        void finalizer_pool::finalizer_main()
+        {
+            object_list batch;
+            while (true)
+            {
+                {
+                    boost::mutex::scoped_lock lock(mutex);
+                    while (!stopping && batches.empty())
+                        batch_ready.wait(lock);
+
+                    // queued batches are destroyed before stopping
+                    if (batches.empty())
+                        return;
+                    batch.swap(batches.back());
+                    batches.pop_back();
+                }
+
+                for (object_list::const_iterator pobj = batch.begin(), last = batch.end(); pobj != last; ++pobj)
+                    destroy_object(*pobj);
+                batch.clear();
+
+                {
+                    boost::mutex::scoped_lock lock(mutex);
+                    ++finished;
+                    idle.push_back(object_list());
+                    idle.back().swap(batch);
+                }
+                batch_done.notify_all();
+            }
+        }
+    }
+}
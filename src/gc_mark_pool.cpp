@@ -0,0 +1,192 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc_mark_pool.h"
+
+namespace lutze
+{
+    namespace detail
+    {
+        // initial number of entries in each mark deque (a power of two)
+        static const size_t deque_min_size = 1024;
+
+        mark_deque::mark_deque() : top(0), bottom(0), items(new buffer(deque_min_size))
+        {
+        }
+
+        mark_deque::~mark_deque()
+        {
+            reset();
+            delete items.load(boost::memory_order_relaxed);
+        }
+
+        void mark_deque::push(const gc_object* pobj)
+        {
+            intptr_t b = bottom.load(boost::memory_order_relaxed);
+            intptr_t t = top.load(boost::memory_order_acquire);
+            buffer* a = items.load(boost::memory_order_relaxed);
+            if (b - t > (intptr_t)a->mask)
+                a = grow(a, t, b);
+            a->items[b & a->mask].store(pobj, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_release);
+            bottom.store(b + 1, boost::memory_order_relaxed);
+        }
+
+        bool mark_deque::take(const gc_object*& pobj)
+        {
+            intptr_t b = bottom.load(boost::memory_order_relaxed) - 1;
+            buffer* a = items.load(boost::memory_order_relaxed);
+            bottom.store(b, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            intptr_t t = top.load(boost::memory_order_relaxed);
+            if (t > b)
+            {
+                bottom.store(b + 1, boost::memory_order_relaxed);
+                return false;
+            }
+            pobj = a->items[b & a->mask].load(boost::memory_order_relaxed);
+            if (t < b)
+                return true;
+
+            // last entry, so race any thief for it
+            bool taken = top.compare_exchange_strong(t, t + 1, boost::memory_order_seq_cst, boost::memory_order_relaxed);
+            bottom.store(b + 1, boost::memory_order_relaxed);
+            return taken;
+        }
+
+        bool mark_deque::steal(const gc_object*& pobj)
+        {
+            intptr_t t = top.load(boost::memory_order_acquire);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            intptr_t b = bottom.load(boost::memory_order_acquire);
+            if (t >= b)
+                return false;
+            buffer* a = items.load(boost::memory_order_acquire);
+            const gc_object* stolen = a->items[t & a->mask].load(boost::memory_order_relaxed);
+            if (!top.compare_exchange_strong(t, t + 1, boost::memory_order_seq_cst, boost::memory_order_relaxed))
+                return false;
+            pobj = stolen;
+            return true;
+        }
+
+        bool mark_deque::empty() const
+        {
+            return top.load(boost::memory_order_acquire) >= bottom.load(boost::memory_order_acquire);
+        }
+
+        void mark_deque::reset()
+        {
+            for (std::vector<buffer*>::iterator old = retired.begin(); old != retired.end(); ++old)
+                delete *old;
+            retired.clear();
+        }
+
+        mark_deque::buffer* mark_deque::grow(buffer* old, intptr_t top, intptr_t bottom)
+        {
+            buffer* a = new buffer((old->mask + 1) * 2);
+            for (intptr_t i = top; i < bottom; ++i)
+                a->items[i & a->mask].store(old->items[i & old->mask].load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+            items.store(a, boost::memory_order_release);
+            retired.push_back(old);
+            return a;
+        }
+
+        mark_pool::mark_pool() : generation(0), running(0), stopping(false)
+        {
+            deques.push_back(new mark_deque);
+        }
+
+        mark_pool::~mark_pool()
+        {
+            resize(0);
+            delete deques[0];
+        }
+
+        void mark_pool::resize(uint32_t helper_count)
+        {
+            boost::mutex::scoped_lock run_lock(run_mutex);
+            {
+                boost::mutex::scoped_lock lock(state_mutex);
+                stopping = true;
+            }
+            task_ready.notify_all();
+            for (std::vector<boost::thread*>::iterator helper = helpers.begin(); helper != helpers.end(); ++helper)
+            {
+                (*helper)->join();
+                delete *helper;
+            }
+            helpers.clear();
+            for (std::vector<mark_deque*>::iterator deque = deques.begin() + 1; deque != deques.end(); ++deque)
+                delete *deque;
+            deques.resize(1);
+
+            stopping = false;
+            for (uint32_t worker = 1; worker <= helper_count; ++worker)
+            {
+                deques.push_back(new mark_deque);
+                helpers.push_back(new boost::thread(&mark_pool::helper_main, this, worker, generation));
+            }
+        }
+
+        uint32_t mark_pool::workers() const
+        {
+            return (uint32_t)deques.size();
+        }
+
+        mark_deque& mark_pool::deque(uint32_t worker)
+        {
+            return *deques[worker];
+        }
+
+        bool mark_pool::run(const task_type& task)
+        {
+            boost::mutex::scoped_try_lock run_lock(run_mutex);
+            if (!run_lock.owns_lock() || helpers.empty())
+                return false;
+
+            {
+                boost::mutex::scoped_lock lock(state_mutex);
+                this->task = task;
+                running = (uint32_t)helpers.size();
+                ++generation;
+            }
+            task_ready.notify_all();
+
+            task(0, (uint32_t)deques.size());
+
+            boost::mutex::scoped_lock lock(state_mutex);
+            while (running != 0)
+                task_done.wait(lock);
+            this->task.clear();
+            for (std::vector<mark_deque*>::iterator deque = deques.begin(); deque != deques.end(); ++deque)
+                (*deque)->reset();
+            return true;
+        }
+
+        void mark_pool::helper_main(uint32_t worker, uint64_t last_generation)
+        {
+            while (true)
+            {
+                task_type current;
+                {
+                    boost::mutex::scoped_lock lock(state_mutex);
+                    while (!stopping && generation == last_generation)
+                        task_ready.wait(lock);
+                    if (stopping)
+                        return;
+                    last_generation = generation;
+                    current = task;
+                }
+
+                current(worker, (uint32_t)deques.size());
+
+                boost::mutex::scoped_lock lock(state_mutex);
+                if (--running == 0)
+                    task_done.notify_one();
+            }
+        }
+    }
+}
@@ -0,0 +1,304 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc_page_map.h"
+#include "gc_scan.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <boost/throw_exception.hpp>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace lutze
+{
+    namespace detail
+    {
+        // addresses resolved together by a batched find
+        static const size_t max_batch = 16;
+
+        // mark words compared by each call to the sweep kernel
+        static const size_t sweep_batch = 256;
+
+        static inline void prefetch(const void* ptr)
+        {
+            #if defined(_MSC_VER)
+            _mm_prefetch((const char*)ptr, _MM_HINT_T0);
+            #else
+            __builtin_prefetch(ptr);
+            #endif
+        }
+
+        // index of the highest set bit in a non-zero word
+        static inline uint32_t highest_bit(uint64_t word)
+        {
+            #if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanReverse64(&index, word);
+            return (uint32_t)index;
+            #else
+            return 63 - (uint32_t)__builtin_clzll(word);
+            #endif
+        }
+
+        page_map::page_map()
+        {
+            // record 0 is reserved so that a zero index means no object
+            record empty = { NULL, 0, 0, 0 };
+            records.push_back(empty);
+            marks.push_back(0);
+        }
+
+        page_map::~page_map()
+        {
+            for (std::vector<page_directory*>::iterator directory = directories.begin(); directory != directories.end(); ++directory)
+            {
+                if (*directory == NULL)
+                    continue;
+                for (uintptr_t leaf = 0; leaf < level_size; ++leaf)
+                {
+                    page_leaf* pleaf = (*directory)->leaves[leaf];
+                    if (pleaf == NULL)
+                        continue;
+                    for (uintptr_t page = 0; page < level_size; ++page)
+                        delete pleaf->pages[page];
+                    delete pleaf;
+                }
+                delete *directory;
+            }
+            for (std::vector<page_info*>::iterator info = free_pages.begin(); info != free_pages.end(); ++info)
+                delete *info;
+        }
+
+        uint32_t page_map::insert(const gc_object* object, const void* start, size_t size)
+        {
+            uint32_t index = (uint32_t)records.size();
+            records.push_back(record());
+            marks.push_back(0);
+
+            record& rec = records[index];
+            rec.object = object;
+            rec.start = (uintptr_t)start;
+            rec.size = (uint32_t)(size == 0 ? 1 : size);
+            rec.flags = 0;
+
+            uintptr_t first_page = rec.start >> page_shift;
+            uintptr_t last_page = (rec.start + rec.size - 1) >> page_shift;
+
+            page_info* info = get_page(first_page);
+            uintptr_t granule = (rec.start >> granule_shift) & (granules - 1);
+            info->starts[granule / 64] |= (uint64_t)1 << (granule % 64);
+            info->records[granule] = index;
+            ++info->count;
+
+            for (uintptr_t page = first_page + 1; page <= last_page; ++page)
+            {
+                info = get_page(page);
+                info->spanning = index;
+                ++info->count;
+            }
+
+            return index;
+        }
+
+        const gc_object* page_map::erase(uint32_t index)
+        {
+            record* rec = &records[index];
+            uintptr_t first_page = rec->start >> page_shift;
+            uintptr_t last_page = (rec->start + rec->size - 1) >> page_shift;
+
+            page_info* info = find_page(first_page);
+            uintptr_t granule = (rec->start >> granule_shift) & (granules - 1);
+            info->starts[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+            info->records[granule] = 0;
+            if (--info->count == 0)
+                release_page(first_page);
+
+            for (uintptr_t page = first_page + 1; page <= last_page; ++page)
+            {
+                info = find_page(page);
+                info->spanning = 0;
+                if (--info->count == 0)
+                    release_page(page);
+            }
+
+            // keep records dense by moving the last record into the hole
+            uint32_t last = (uint32_t)records.size() - 1;
+            const gc_object* moved = NULL;
+            if (index != last)
+            {
+                records[index] = records[last];
+                marks[index] = marks[last];
+                rec = &records[index];
+                moved = rec->object;
+
+                first_page = rec->start >> page_shift;
+                last_page = (rec->start + rec->size - 1) >> page_shift;
+                granule = (rec->start >> granule_shift) & (granules - 1);
+                find_page(first_page)->records[granule] = index;
+                for (uintptr_t page = first_page + 1; page <= last_page; ++page)
+                    find_page(page)->spanning = index;
+            }
+            records.pop_back();
+            marks.pop_back();
+            return moved;
+        }
+
+        void page_map::unmarked(uint32_t token, std::vector<uint32_t>& indices) const
+        {
+            static const sweep_kernel kernel = get_sweep_kernel();
+
+            // record 0 is reserved, so is never swept
+            uint32_t found[sweep_batch];
+            for (size_t first = 1; first < marks.size(); first += sweep_batch)
+            {
+                size_t count = std::min(sweep_batch, marks.size() - first);
+                size_t dead = kernel(&marks[first], count, token, (uint32_t)first, found);
+                indices.insert(indices.end(), found, found + dead);
+            }
+        }
+
+        page_map::record* page_map::find(const void* ptr) const
+        {
+            uintptr_t address = (uintptr_t)ptr;
+            page_info* info = find_page(address >> page_shift);
+            if (info == NULL)
+                return NULL;
+            uint32_t index = find_index(info, address);
+            if (index == 0)
+                return NULL;
+            const record& rec = records[index];
+            if (address - rec.start >= rec.size)
+                return NULL;
+            return const_cast<record*>(&rec);
+        }
+
+        void page_map::find(const uintptr_t* addresses, size_t count, record** results) const
+        {
+            // resolve pages first, prefetching the page bitmaps
+            const page_info* infos[max_batch];
+            for (size_t first = 0; first < count; first += max_batch)
+            {
+                size_t last = std::min(count, first + max_batch);
+                for (size_t i = first; i < last; ++i)
+                {
+                    infos[i - first] = find_page(addresses[i] >> page_shift);
+                    prefetch(infos[i - first]);
+                }
+
+                // then search bitmaps, prefetching the matching records
+                for (size_t i = first; i < last; ++i)
+                {
+                    const page_info* info = infos[i - first];
+                    uint32_t index = info == NULL ? 0 : find_index(info, addresses[i]);
+                    results[i] = index == 0 ? NULL : const_cast<record*>(&records[index]);
+                    prefetch(results[i]);
+                }
+
+                // finally check each address lies within its record
+                for (size_t i = first; i < last; ++i)
+                {
+                    if (results[i] != NULL && addresses[i] - results[i]->start >= results[i]->size)
+                        results[i] = NULL;
+                }
+            }
+        }
+
+        uint32_t page_map::find_index(const page_info* info, uintptr_t address) const
+        {
+            // nearest object start at or below the address within this page,
+            // otherwise the object spanning into the page
+            uintptr_t granule = (address >> granule_shift) & (granules - 1);
+            for (intptr_t word = (intptr_t)(granule / 64); word >= 0; --word)
+            {
+                uint64_t starts = info->starts[word];
+                if ((uintptr_t)word == granule / 64)
+                    starts &= ~(uint64_t)0 >> (63 - granule % 64);
+                if (starts != 0)
+                    return info->records[word * 64 + highest_bit(starts)];
+            }
+            return info->spanning;
+        }
+
+        size_t page_map::size() const
+        {
+            return records.size() - 1;
+        }
+
+        page_map::iterator page_map::begin()
+        {
+            return records.begin() + 1;
+        }
+
+        page_map::iterator page_map::end()
+        {
+            return records.end();
+        }
+
+        page_map::const_iterator page_map::begin() const
+        {
+            return records.begin() + 1;
+        }
+
+        page_map::const_iterator page_map::end() const
+        {
+            return records.end();
+        }
+
+        page_map::page_info* page_map::find_page(uintptr_t page) const
+        {
+            uintptr_t directory = page >> (level_bits * 2);
+            if (directory >= directories.size() || directories[directory] == NULL)
+                return NULL;
+            page_leaf* leaf = directories[directory]->leaves[(page >> level_bits) & (level_size - 1)];
+            if (leaf == NULL)
+                return NULL;
+            return leaf->pages[page & (level_size - 1)];
+        }
+
+        page_map::page_info* page_map::get_page(uintptr_t page)
+        {
+            uintptr_t directory = page >> (level_bits * 2);
+            if (directory >= level_size)
+                boost::throw_exception(std::runtime_error("object address outside page map range"));
+            if (directory >= directories.size())
+                directories.resize(directory + 1, NULL);
+            if (directories[directory] == NULL)
+            {
+                directories[directory] = new page_directory;
+                std::memset(directories[directory], 0, sizeof(page_directory));
+            }
+            page_leaf*& leaf = directories[directory]->leaves[(page >> level_bits) & (level_size - 1)];
+            if (leaf == NULL)
+            {
+                leaf = new page_leaf;
+                std::memset(leaf, 0, sizeof(page_leaf));
+            }
+            page_info*& info = leaf->pages[page & (level_size - 1)];
+            if (info == NULL)
+            {
+                if (free_pages.empty())
+                    info = new page_info;
+                else
+                {
+                    info = free_pages.back();
+                    free_pages.pop_back();
+                }
+                std::memset(info, 0, sizeof(page_info));
+            }
+            return info;
+        }
+
+        void page_map::release_page(uintptr_t page)
+        {
+            page_leaf* leaf = directories[page >> (level_bits * 2)]->leaves[(page >> level_bits) & (level_size - 1)];
+            free_pages.push_back(leaf->pages[page & (level_size - 1)]);
+            leaf->pages[page & (level_size - 1)] = NULL;
+        }
+    }
+}
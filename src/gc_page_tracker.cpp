@@ -0,0 +1,129 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc_page_tracker.h"
+#include <boost/thread/mutex.hpp>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace lutze
+{
+    // pagemap entries read by each query that misses the cached block
+    static const size_t block_entries = 512;
+
+    // soft-dirty flag within a pagemap entry
+    static const uint64_t soft_dirty_bit = (uint64_t)1 << 55;
+
+    // clear_refs resets the bits of every page in the process, so trackers
+    // record how many clears have happened to detect those made by others
+    static boost::mutex clear_mutex;
+    static uint32_t clear_count = 0;
+
+    soft_dirty_tracker::soft_dirty_tracker() : pagemap(-1), page_shift(12), epoch(0), block_first(~(uintptr_t)0)
+    {
+        #if defined(__linux__)
+        pagemap = ::open("/proc/self/pagemap", O_RDONLY);
+        uintptr_t page_size = (uintptr_t)::sysconf(_SC_PAGESIZE);
+        page_shift = 0;
+        while (((uintptr_t)1 << page_shift) < page_size)
+            ++page_shift;
+        #endif
+    }
+
+    soft_dirty_tracker::~soft_dirty_tracker()
+    {
+        #if defined(__linux__)
+        if (pagemap != -1)
+            ::close(pagemap);
+        #endif
+    }
+
+    bool soft_dirty_tracker::supported()
+    {
+        #if defined(__linux__)
+        static int32_t result = -1;
+        boost::mutex::scoped_lock lock(clear_mutex);
+        if (result == -1)
+        {
+            // a freshly written page must be reported dirty (kernels without
+            // soft-dirty support accept clear_refs but never set the bit)
+            static volatile uint8_t probe[8192];
+            probe[4096] = 1;
+            uintptr_t page = (uintptr_t)&probe[4096] / (uintptr_t)::sysconf(_SC_PAGESIZE);
+            int fd = ::open("/proc/self/pagemap", O_RDONLY);
+            uint64_t entry = 0;
+            bool readable = fd != -1 && ::pread(fd, &entry, sizeof(entry), (off_t)(page * sizeof(entry))) == (ssize_t)sizeof(entry);
+            if (fd != -1)
+                ::close(fd);
+            int clear_fd = ::open("/proc/self/clear_refs", O_WRONLY);
+            if (clear_fd != -1)
+                ::close(clear_fd);
+            result = readable && clear_fd != -1 && (entry & soft_dirty_bit) != 0;
+        }
+        return result == 1;
+        #else
+        return false;
+        #endif
+    }
+
+    bool soft_dirty_tracker::begin()
+    {
+        block_first = ~(uintptr_t)0;
+        boost::mutex::scoped_lock lock(clear_mutex);
+        return pagemap != -1 && epoch != 0 && epoch == clear_count;
+    }
+
+    bool soft_dirty_tracker::written(const void* ptr, size_t size)
+    {
+        uintptr_t first = (uintptr_t)ptr >> page_shift;
+        uintptr_t last = ((uintptr_t)ptr + (size == 0 ? 0 : size - 1)) >> page_shift;
+        for (uintptr_t page = first; page <= last; ++page)
+        {
+            if ((page_entry(page) & soft_dirty_bit) != 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool soft_dirty_tracker::reset()
+    {
+        #if defined(__linux__)
+        boost::mutex::scoped_lock lock(clear_mutex);
+        int fd = ::open("/proc/self/clear_refs", O_WRONLY);
+        bool cleared = fd != -1 && ::write(fd, "4", 1) == 1;
+        if (fd != -1)
+            ::close(fd);
+        epoch = cleared ? ++clear_count : 0;
+        return cleared;
+        #else
+        return false;
+        #endif
+    }
+
+    uint64_t soft_dirty_tracker::page_entry(uintptr_t page)
+    {
+        #if defined(__linux__)
+        if (page - block_first >= block.size())
+        {
+            block_first = page & ~(uintptr_t)(block_entries - 1);
+            block.resize(block_entries);
+            ssize_t bytes = ::pread(pagemap, &block[0], block_entries * sizeof(uint64_t), (off_t)(block_first * sizeof(uint64_t)));
+            if (bytes < (ssize_t)sizeof(uint64_t))
+            {
+                block_first = ~(uintptr_t)0;
+                return soft_dirty_bit; // unknown pages are treated as written
+            }
+            block.resize((size_t)bytes / sizeof(uint64_t));
+        }
+        return block[page - block_first];
+        #else
+        return soft_dirty_bit;
+        #endif
+    }
+}
@@ -0,0 +1,238 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include "gc_scan.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GC_SCAN_X86_64
+#endif
+
+#if defined(GC_SCAN_X86_64)
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GC_TARGET_AVX2
+#else
+#define GC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#endif
+
+namespace lutze
+{
+    namespace detail
+    {
+        size_t scan_words_scalar(const uintptr_t* words, size_t count, uintptr_t heap_min, uintptr_t heap_max, uintptr_t* candidates)
+        {
+            if (heap_min > heap_max)
+                return 0;
+            uintptr_t span = heap_max - heap_min;
+            size_t found = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uintptr_t word = words[i];
+                candidates[found] = word;
+                found += word - heap_min <= span;
+            }
+            return found;
+        }
+
+        size_t sweep_marks_scalar(const uint32_t* marks, size_t count, uint32_t token, uint32_t first, uint32_t* unmarked)
+        {
+            size_t found = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                unmarked[found] = first + (uint32_t)i;
+                found += marks[i] != token;
+            }
+            return found;
+        }
+
+        #if defined(GC_SCAN_X86_64)
+
+        // range check is performed as an unsigned comparison of (word - heap_min)
+        // against the heap span, emulated using signed compares with the sign
+        // bit flipped; sse2 lacks 64-bit compares so is limited to spans < 4gb;
+        // the value of a word is not checked for alignment, since an interior
+        // pointer (such as into a string) may point anywhere in an object
+
+        static size_t scan_words_sse2(const uintptr_t* words, size_t count, uintptr_t heap_min, uintptr_t heap_max, uintptr_t* candidates)
+        {
+            if (heap_min > heap_max)
+                return 0;
+            uintptr_t span = heap_max - heap_min;
+            if (span > 0xffffffffULL)
+                return scan_words_scalar(words, count, heap_min, heap_max, candidates);
+
+            const __m128i sign = _mm_set1_epi32((int)0x80000000);
+            const __m128i lo = _mm_set1_epi64x((long long)heap_min);
+            const __m128i limit = _mm_xor_si128(_mm_set_epi32(0, (int)(uint32_t)span, 0, (int)(uint32_t)span), sign);
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 2 <= count; i += 2)
+            {
+                __m128i word = _mm_loadu_si128((const __m128i*)(words + i));
+                __m128i offset = _mm_sub_epi64(word, lo);
+                __m128i above = _mm_cmpgt_epi32(_mm_xor_si128(offset, sign), limit);
+                above = _mm_or_si128(above, _mm_shuffle_epi32(above, _MM_SHUFFLE(2, 3, 0, 1)));
+                int mask = _mm_movemask_pd(_mm_castsi128_pd(above)) ^ 0x3;
+                candidates[found] = words[i];
+                found += mask & 1;
+                candidates[found] = words[i + 1];
+                found += (mask >> 1) & 1;
+            }
+            return found + scan_words_scalar(words + i, count - i, heap_min, heap_max, candidates + found);
+        }
+
+        GC_TARGET_AVX2
+        static size_t scan_words_avx2(const uintptr_t* words, size_t count, uintptr_t heap_min, uintptr_t heap_max, uintptr_t* candidates)
+        {
+            if (heap_min > heap_max)
+                return 0;
+            uintptr_t span = heap_max - heap_min;
+
+            const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+            const __m256i lo = _mm256_set1_epi64x((long long)heap_min);
+            const __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x((long long)span), sign);
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                __m256i word = _mm256_loadu_si256((const __m256i*)(words + i));
+                __m256i offset = _mm256_sub_epi64(word, lo);
+                __m256i above = _mm256_cmpgt_epi64(_mm256_xor_si256(offset, sign), limit);
+                int mask = _mm256_movemask_pd(_mm256_castsi256_pd(above)) ^ 0xf;
+                candidates[found] = words[i];
+                found += mask & 1;
+                candidates[found] = words[i + 1];
+                found += (mask >> 1) & 1;
+                candidates[found] = words[i + 2];
+                found += (mask >> 2) & 1;
+                candidates[found] = words[i + 3];
+                found += (mask >> 3) & 1;
+            }
+            return found + scan_words_scalar(words + i, count - i, heap_min, heap_max, candidates + found);
+        }
+
+        // groups of mark words that are all equal to the token (the common case
+        // for a mostly live heap) are skipped after a single compare
+
+        static size_t sweep_marks_sse2(const uint32_t* marks, size_t count, uint32_t token, uint32_t first, uint32_t* unmarked)
+        {
+            const __m128i expected = _mm_set1_epi32((int)token);
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128i mark = _mm_loadu_si128((const __m128i*)(marks + i));
+                int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(mark, expected))) ^ 0xf;
+                if (mask == 0)
+                    continue;
+                for (uint32_t lane = 0; lane < 4; ++lane)
+                {
+                    unmarked[found] = first + (uint32_t)i + lane;
+                    found += (mask >> lane) & 1;
+                }
+            }
+            return found + sweep_marks_scalar(marks + i, count - i, token, first + (uint32_t)i, unmarked + found);
+        }
+
+        GC_TARGET_AVX2
+        static size_t sweep_marks_avx2(const uint32_t* marks, size_t count, uint32_t token, uint32_t first, uint32_t* unmarked)
+        {
+            const __m256i expected = _mm256_set1_epi32((int)token);
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                __m256i mark = _mm256_loadu_si256((const __m256i*)(marks + i));
+                int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(mark, expected))) ^ 0xff;
+                if (mask == 0)
+                    continue;
+                for (uint32_t lane = 0; lane < 8; ++lane)
+                {
+                    unmarked[found] = first + (uint32_t)i + lane;
+                    found += (mask >> lane) & 1;
+                }
+            }
+            return found + sweep_marks_scalar(marks + i, count - i, token, first + (uint32_t)i, unmarked + found);
+        }
+
+        static bool cpu_supports_avx2()
+        {
+            #if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+                return false;
+            __cpuid(info, 1);
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+            #else
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") != 0;
+            #endif
+        }
+
+        #endif
+
+        size_t get_supported_kernels(scan_kernel_entry* kernels)
+        {
+            size_t count = 0;
+            #if defined(GC_SCAN_X86_64)
+            if (cpu_supports_avx2())
+            {
+                scan_kernel_entry avx2 = { scan_words_avx2, sweep_marks_avx2, "avx2" };
+                kernels[count++] = avx2;
+            }
+            scan_kernel_entry sse2 = { scan_words_sse2, sweep_marks_sse2, "sse2" };
+            kernels[count++] = sse2;
+            #endif
+            scan_kernel_entry scalar = { scan_words_scalar, sweep_marks_scalar, "scalar" };
+            kernels[count++] = scalar;
+            return count;
+        }
+
+        static scan_kernel_entry select_scan_kernel()
+        {
+            scan_kernel_entry kernels[max_scan_kernels];
+            get_supported_kernels(kernels);
+            return kernels[0];
+        }
+
+        static const scan_kernel_entry& selected_scan_kernel()
+        {
+            static const scan_kernel_entry entry = select_scan_kernel();
+            return entry;
+        }
+
+        scan_kernel get_scan_kernel()
+        {
+            return selected_scan_kernel().kernel;
+        }
+
+        sweep_kernel get_sweep_kernel()
+        {
+            return selected_scan_kernel().sweep;
+        }
+
+        const char* get_scan_kernel_name()
+        {
+            return selected_scan_kernel().name;
+        }
+    }
+}
@@ -0,0 +1,214 @@
+/////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2009-2012 Alan Wright. All rights reserved.
+// Distributable under the terms of either the Apache License (Version 2.0)
+// or the GNU Lesser General Public License.
+/////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/thread.hpp>
+#include "gc.h"
+#include "gc_array.h"
+
+using namespace lutze;
+
+class bench_object;
+typedef gc_ptr<bench_object> bench_object_ptr;
+
+class bench_object : public gc_object
+{
+public:
+    virtual void mark_members(gc* gc) const
+    {
+        gc->mark(left);
+        gc->mark(right);
+    }
+
+    bench_object_ptr left;
+    bench_object_ptr right;
+};
+
+// the same node freed without running its destructor
+class trivial_bench_object : public bench_object
+{
+};
+
+namespace lutze
+{
+    template <>
+    struct gc_trivially_destructible<trivial_bench_object> : public boost::true_type
+    {
+    };
+}
+
+// build a complete binary tree, so marking depth stays small
+static bench_object_ptr build_tree(int32_t depth, bool trivial = false)
+{
+    bench_object_ptr node = trivial ? bench_object_ptr(new_gc<trivial_bench_object>()) : new_gc<bench_object>();
+    if (depth > 1)
+    {
+        node->left = build_tree(depth - 1, trivial);
+        node->right = build_tree(depth - 1, trivial);
+    }
+    return node;
+}
+
+static double elapsed_ms(const boost::posix_time::ptime& start)
+{
+    return (double)(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    int32_t depth = argc > 1 ? std::atoi(argv[1]) : 17;
+    size_t objects = ((size_t)1 << depth) - 1;
+
+    gc::gc_init();
+
+    std::cout << "objects:                   " << objects << "\n";
+    std::cout << "header bytes per object:   " << sizeof(gc_object) - sizeof(void*) << "\n";
+    std::cout << "registry bytes per object: " << sizeof(detail::page_map::record) + sizeof(uint32_t) << "\n";
+    std::cout << "queue bytes per object:    " << sizeof(gc_object*) << "\n";
+
+    // before the intrusive header, queues copied an 88 byte gc_node holding
+    // an empty std::set, next to a 24 byte registry record with no header
+    std::cout << "previous gc_node layout:   header 0, registry 24, queue 88 bytes per object\n";
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    bench_object_ptr root = build_tree(depth);
+    std::cout << "allocate:                  " << elapsed_ms(start) << " ms\n";
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    std::cout << "collect (live):            " << elapsed_ms(start) << " ms\n";
+
+    // pause of a live collection as marking is shared with helper threads
+    uint32_t max_helpers = std::max(3u, boost::thread::hardware_concurrency() - 1);
+    for (uint32_t helpers = 1; helpers <= max_helpers; helpers *= 2)
+    {
+        gc::set_mark_threads(helpers);
+        start = boost::posix_time::microsec_clock::universal_time();
+        gc::get_gc().collect(true);
+        std::cout << "collect (live, " << helpers << " helpers): " << elapsed_ms(start) << " ms\n";
+    }
+    gc::set_mark_threads(0);
+
+    // longest pause of a live collection marked a slice at a time
+    uint32_t slices = 0;
+    double longest_ms = 0;
+    for (bool marking = true; marking; ++slices)
+    {
+        start = boost::posix_time::microsec_clock::universal_time();
+        marking = gc::get_gc().collect_slice(1000, slices == 0);
+        longest_ms = std::max(longest_ms, elapsed_ms(start));
+    }
+    std::cout << "collect (live, 1 ms slices): " << slices << " slices, longest " << longest_ms << " ms\n";
+
+    // pause to snapshot roots for a live collection marked concurrently
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::collect_handle handle = gc::get_gc().collect_async();
+    double snapshot_ms = elapsed_ms(start);
+    handle.wait();
+    std::cout << "collect (live, concurrent): pause " << snapshot_ms << " ms, total " << elapsed_ms(start) << " ms\n";
+    gc::get_gc().collect();
+
+    // allocation of a second tree, where the collections from new_gc are
+    // minor ones until as many objects again have been promoted
+    gc::get_gc().set_generational(true);
+    gc::get_gc().collect(true);
+    start = boost::posix_time::microsec_clock::universal_time();
+    bench_object_ptr second = build_tree(depth);
+    std::cout << "allocate (generational):   " << elapsed_ms(start) << " ms\n";
+
+    // pause of a minor collection with a young subtree stored in the
+    // promoted tree
+    root->left->left = build_tree(8);
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect_nursery();
+    std::cout << "collect (minor):           " << elapsed_ms(start) << " ms\n";
+    gc::get_gc().set_generational(false);
+
+    // longest call to new_gc once the second tree is dead, as the collection
+    // finding it leaves its destruction to the calls that follow
+    second.reset();
+    const gc_stats& stats = gc::get_gc().stats();
+    uint64_t destroyed = stats.objects_destroyed;
+    uint64_t steps = stats.sweep_steps;
+    double collect_ms = 0;
+    longest_ms = 0;
+    for (uint32_t calls = 0; calls < 10000 && stats.objects_destroyed - destroyed < objects; ++calls)
+    {
+        uint64_t collections = stats.collections;
+        start = boost::posix_time::microsec_clock::universal_time();
+        new_gc<bench_object>();
+        if (stats.collections != collections)
+            collect_ms = std::max(collect_ms, elapsed_ms(start));
+        else
+            longest_ms = std::max(longest_ms, elapsed_ms(start));
+    }
+    std::cout << "collect (dead, lazy):      pause " << collect_ms << " ms, " << stats.sweep_steps - steps << " steps, longest " << longest_ms << " ms\n";
+
+    // pause of a collection finding a dead tree when its destructors are run
+    // by a finalizer thread, and the time until they have all run
+    gc::get_gc().set_generational(true);
+    second = build_tree(depth);
+    gc::get_gc().set_generational(false);
+    gc::set_finalizer_threads(1);
+    gc::get_gc().unmark(second); // the tree may still be found through a stale temporary
+    second.reset();
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    double pause_ms = elapsed_ms(start);
+    gc::flush_finalizers();
+    std::cout << "collect (dead, finalizer): pause " << pause_ms << " ms, destroyed after " << elapsed_ms(start) << " ms\n";
+    gc::set_finalizer_threads(0);
+
+    gc::get_gc().unmark(root);
+    root.reset();
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    std::cout << "collect (dead):            " << elapsed_ms(start) << " ms\n";
+
+    // the same collection for a tree of trivially destructible objects
+    root = build_tree(depth, true);
+    gc::get_gc().collect(true);
+    gc::get_gc().unmark(root);
+    root.reset();
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    std::cout << "collect (dead, trivial):   " << elapsed_ms(start) << " ms\n";
+
+    // the same tree allocated as a single array, with children at 2i+1 and
+    // 2i+2, so it is registered and traced as one object
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc_ptr< gc_array<bench_object> > nodes = new_gc_array<bench_object>(objects);
+    bench_object* first = nodes->begin();
+    for (size_t i = 0; 2 * i + 2 < objects; ++i)
+    {
+        first[i].left = (*nodes)[2 * i + 1];
+        first[i].right = (*nodes)[2 * i + 2];
+    }
+    std::cout << "allocate (array):          " << elapsed_ms(start) << " ms\n";
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    std::cout << "collect (live, array):     " << elapsed_ms(start) << " ms\n";
+
+    first = NULL;
+    gc::get_gc().unmark(nodes);
+    nodes.reset();
+    start = boost::posix_time::microsec_clock::universal_time();
+    gc::get_gc().collect(true);
+    std::cout << "collect (dead, array):     " << elapsed_ms(start) << " ms\n";
+
+    // heap memory once the trees are dead, after a further collection so
+    // that chunks emptied by the last are released
+    gc::get_gc().collect(true);
+    std::cout << "heap (dead):               reserved " << stats.heap_bytes_reserved / 1024 << " KB, committed " <<
+        stats.heap_bytes_committed / 1024 << " KB, released " << stats.heap_bytes_released / 1024 << " KB\n";
+
+    gc::gc_term();
+    return 0;
+}
@@ -4,13 +4,66 @@
 // or the GNU Lesser General Public License.
 /////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <cstdlib>
+#include <list>
+#include <new>
 #include <boost/test/unit_test.hpp>
 #include <boost/thread.hpp>
 #include "gc.h"
+#include "gc_array.h"
 #include "gc_container.h"
+#include "gc_mark_pool.h"
+#include "gc_scan.h"
+#include "gc_string.h"
+
+#if defined(GC_PLATFORM_LINUX)
+#include <ucontext.h>
+#endif
 
 using namespace lutze;
 
+// heap allocations counted while a test enables counting
+static volatile bool count_allocations = false;
+static int32_t allocation_count = 0;
+
+void* operator new(size_t size)
+{
+    if (count_allocations)
+        ++allocation_count;
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// the sized and array forms are replaced too, so every deallocation pairs
+// with the malloc above
+void operator delete(void* ptr) throw()
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) throw()
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) throw()
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) throw()
+{
+    std::free(ptr);
+}
+
 class global_fixture
 {
 public:
@@ -30,7 +83,7 @@ BOOST_GLOBAL_FIXTURE(global_fixture);
 class collection_fixture
 {
 public:
-    collection_fixture() // setup
+    collection_fixture() : harness(this + 1, gc::get_gc().stack_top() - (uintptr_t)(this + 1)) // setup
     {
     }
 
@@ -38,6 +91,9 @@ public:
     {
         gc::get_gc().final_collect();
     }
+
+    // test framework frames above the fixture may hold stale heap addresses
+    gc::no_scan_region harness;
 };
 
 BOOST_FIXTURE_TEST_SUITE(collection_test, collection_fixture)
@@ -145,10 +201,17 @@ namespace test_collect_mark
     class test_object : public gc_object
     {
     public:
+        test_object() : marks(0)
+        {
+        }
+
         virtual void mark_members(gc* gc) const
         {
             ++mark_count;
+            ++marks;
         }
+
+        mutable int32_t marks;
     };
 
     typedef gc_ptr<test_object> test_object_ptr;
@@ -157,8 +220,20 @@ namespace test_collect_mark
     {
         test_object_ptr test = new_gc<test_object>();
         BOOST_CHECK_EQUAL(mark_count, 0);
+        gc_stats before = gc::get_gc().stats();
         gc::get_gc().collect(true);
-        BOOST_CHECK_EQUAL(mark_count, 1);
+        gc_stats after = gc::get_gc().stats();
+        BOOST_CHECK_EQUAL(mark_count, 1); // root must survive stack prefiltering
+        BOOST_CHECK_EQUAL(after.collections, before.collections + 1);
+        BOOST_CHECK_EQUAL(after.scan_candidates - before.scan_candidates,
+                          (after.scan_lookups - before.scan_lookups) + (after.scan_filtered - before.scan_filtered));
+        #if defined(GC_PRECISE_ROOTS)
+        BOOST_CHECK_EQUAL(after.last_scan_bytes, 0); // no stack memory is scanned
+        #else
+        BOOST_CHECK_GT(after.scan_filtered, before.scan_filtered);
+        BOOST_CHECK_GT(after.last_scan_bytes, 0);
+        BOOST_CHECK_EQUAL(after.scan_bytes - before.scan_bytes, after.last_scan_bytes);
+        #endif
         return test_object_ptr();
     }
 
@@ -169,6 +244,163 @@ namespace test_collect_mark
     }
 }
 
+namespace test_incremental_stack_scan
+{
+    class test_object : public gc_object
+    {
+    public:
+        test_object() : marks(0)
+        {
+        }
+
+        virtual void mark_members(gc* gc) const
+        {
+            ++marks;
+        }
+
+        mutable int32_t marks;
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    #if defined(GC_INCREMENTAL_STACK_SCAN) && !defined(GC_PRECISE_ROOTS)
+    void _test_deep_collect()
+    {
+        // push the collector frames well below the caller's stack chunk
+        volatile uint8_t buffer[16384];
+        buffer[0] = 0;
+        buffer[sizeof(buffer) - 1] = 0;
+        gc::get_gc().collect(true);
+        gc::get_gc().collect(true);
+    }
+
+    void _test_incremental_scan()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        test->marks = 0;
+        _test_deep_collect();
+        BOOST_CHECK_EQUAL(test->marks, 2); // root in unchanged chunk must be found again
+        BOOST_CHECK_GT(gc::get_gc().stats().last_scan_bytes_skipped, 0);
+        gc::get_gc().unmark(test); // simulate out of scope
+    }
+    #endif
+
+    BOOST_AUTO_TEST_CASE(test_incremental_stack_scan)
+    {
+        #if defined(GC_INCREMENTAL_STACK_SCAN) && !defined(GC_PRECISE_ROOTS)
+        _test_incremental_scan();
+        #endif
+        gc::get_gc().collect(true);
+    }
+}
+
+namespace test_scan_kernel
+{
+    void _test_scan_kernel(const detail::scan_kernel_entry& entry)
+    {
+        const uintptr_t heap_min = (uintptr_t)0x10000;
+        const uintptr_t heap_max = (uintptr_t)0x20000;
+
+        // boundary, unaligned and out of range words plus pseudo-random noise
+        std::vector<uintptr_t> words;
+        words.push_back(heap_min);
+        words.push_back(heap_max);
+        words.push_back(heap_max + 0x8);
+        words.push_back(heap_max + 0xf);
+        words.push_back(heap_max + 0x10);
+        words.push_back(heap_min - sizeof(void*));
+        words.push_back(heap_min + 1);
+        words.push_back(0);
+        words.push_back(~(uintptr_t)0);
+        uint32_t seed = 12345;
+        for (int32_t i = 0; i < 1001; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            words.push_back(heap_min - 0x1000 + (seed % 0x12000));
+        }
+
+        std::vector<uintptr_t> expected(words.size());
+        std::vector<uintptr_t> actual(words.size());
+        size_t expected_count = detail::scan_words_scalar(&words[0], words.size(), heap_min, heap_max, &expected[0]);
+        size_t actual_count = entry.kernel(&words[0], words.size(), heap_min, heap_max, &actual[0]);
+
+        BOOST_TEST_MESSAGE("scan kernel: " << entry.name);
+        BOOST_CHECK_GE(expected_count, (size_t)3);
+        BOOST_CHECK_EQUAL(expected[0], heap_min);
+        BOOST_CHECK_EQUAL(expected[1], heap_max);
+        BOOST_CHECK_EQUAL(expected[2], heap_min + 1); // unaligned words are kept
+        BOOST_REQUIRE_EQUAL(actual_count, expected_count);
+        BOOST_CHECK(std::equal(expected.begin(), expected.begin() + expected_count, actual.begin()));
+
+        // empty registry range never produces candidates
+        BOOST_CHECK_EQUAL(entry.kernel(&words[0], words.size(), heap_max, heap_min, &actual[0]), (size_t)0);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_scan_kernel)
+    {
+        detail::scan_kernel_entry kernels[detail::max_scan_kernels];
+        size_t count = detail::get_supported_kernels(kernels);
+        BOOST_REQUIRE_GE(count, (size_t)1);
+        BOOST_CHECK_EQUAL(std::string(kernels[count - 1].name), "scalar");
+        BOOST_CHECK_EQUAL(std::string(kernels[0].name), detail::get_scan_kernel_name());
+        BOOST_CHECK(kernels[0].kernel == detail::get_scan_kernel());
+
+        // every kernel the processor supports must agree with the portable kernel
+        for (size_t i = 0; i < count; ++i)
+            _test_scan_kernel(kernels[i]);
+    }
+}
+
+namespace test_sweep_kernel
+{
+    void _test_sweep_kernel(const detail::scan_kernel_entry& entry)
+    {
+        const uint32_t token = 7;
+
+        // runs of marked words (skipped whole) mixed with sparse unmarked words
+        std::vector<uint32_t> marks(1003, token);
+        marks[0] = 0;
+        marks[5] = token - 1;
+        marks[6] = token + 1;
+        marks[1002] = 0;
+        uint32_t seed = 12345;
+        for (int32_t i = 0; i < 100; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            marks[64 + (seed % 900)] = seed % 3 == 0 ? token : 0;
+        }
+
+        std::vector<uint32_t> expected(marks.size());
+        std::vector<uint32_t> actual(marks.size());
+        size_t expected_count = detail::sweep_marks_scalar(&marks[0], marks.size(), token, 1, &expected[0]);
+        size_t actual_count = entry.sweep(&marks[0], marks.size(), token, 1, &actual[0]);
+
+        BOOST_TEST_MESSAGE("sweep kernel: " << entry.name);
+        BOOST_CHECK_GE(expected_count, (size_t)4);
+        BOOST_CHECK_EQUAL(expected[0], (uint32_t)1);
+        BOOST_CHECK_EQUAL(expected[1], (uint32_t)6);
+        BOOST_CHECK_EQUAL(expected[2], (uint32_t)7);
+        BOOST_CHECK_EQUAL(expected[expected_count - 1], (uint32_t)1003);
+        BOOST_REQUIRE_EQUAL(actual_count, expected_count);
+        BOOST_CHECK(std::equal(expected.begin(), expected.begin() + expected_count, actual.begin()));
+
+        // a fully marked range has no unmarked words
+        std::fill(marks.begin(), marks.end(), token);
+        BOOST_CHECK_EQUAL(entry.sweep(&marks[0], marks.size(), token, 1, &actual[0]), (size_t)0);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_sweep_kernel)
+    {
+        detail::scan_kernel_entry kernels[detail::max_scan_kernels];
+        size_t count = detail::get_supported_kernels(kernels);
+        BOOST_CHECK(kernels[0].sweep == detail::get_sweep_kernel());
+
+        // every kernel the processor supports must agree with the portable kernel
+        for (size_t i = 0; i < count; ++i)
+            _test_sweep_kernel(kernels[i]);
+    }
+}
+
 namespace null_member_collect
 {
     int32_t instance_count = 0;
@@ -357,171 +589,1788 @@ namespace non_gc_collect
         gc::get_gc().collect(true);
         gc::get_gc().unmark(test->child1);
         gc::get_gc().unmark(test); // simulate out of scope
-        return member_test_object_ptr();
+        return member_test_object_ptr();
+    }
+
+    BOOST_AUTO_TEST_CASE(test_non_gc_collect)
+    {
+        _member_test_object();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        BOOST_CHECK_EQUAL(managed_count, 0);
+        BOOST_CHECK_EQUAL(unmanaged_count, 0);
+    }
+}
+
+namespace cyclic_reference
+{
+    int32_t instance_count = 0;
+
+    class cycle_object;
+    typedef gc_ptr<cycle_object> cycle_object_ptr;
+
+    class cycle_object : public gc_object
+    {
+    public:
+        cycle_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~cycle_object()
+        {
+            --instance_count;
+        }
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(other);
+        }
+
+        void set_other(cycle_object_ptr other)
+        {
+            this->other = other;
+        }
+
+        cycle_object_ptr other;
+    };
+
+    cycle_object_ptr _test_cyclic_references()
+    {
+        cycle_object_ptr test1 = new_gc<cycle_object>();
+        cycle_object_ptr test2 = new_gc<cycle_object>();
+        test1->set_other(test2);
+        test2->set_other(test1);
+        BOOST_CHECK_NE(instance_count, 0);
+        gc::get_gc().collect(true);
+        gc::get_gc().unmark(test1); // simulate out of scope
+        gc::get_gc().unmark(test2); // simulate out of scope
+        return cycle_object_ptr();
+    }
+
+    BOOST_AUTO_TEST_CASE(test_cyclic_references)
+    {
+        _test_cyclic_references();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace recursive_stack
+{
+    int32_t instance_count = 0;
+
+    class fib_object : public gc_object
+    {
+    public:
+        fib_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~fib_object()
+        {
+            --instance_count;
+        }
+
+        int32_t fibonacci(int32_t n)
+        {
+            if (n < 2)
+                return n;
+            return new_gc<fib_object>()->fibonacci(n - 1) + new_gc<fib_object>()->fibonacci(n - 2);
+        }
+    };
+
+    typedef gc_ptr<fib_object> fib_object_ptr;
+
+    fib_object_ptr _test_recursive()
+    {
+        fib_object_ptr test = new_gc<fib_object>();
+        BOOST_CHECK_EQUAL(test->fibonacci(20), 6765);
+        BOOST_CHECK_NE(instance_count, 0);
+        gc::get_gc().collect(true);
+        gc::get_gc().unmark(test); // simulate out of scope
+        return fib_object_ptr();
+    }
+
+    BOOST_AUTO_TEST_CASE(test_recursive)
+    {
+        _test_recursive();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace deep_call_graph_reference
+{
+    int32_t instance_count = 0;
+    int32_t level_count = 0;
+
+    class deep_object;
+    typedef gc_ptr<deep_object> deep_object_ptr;
+
+    class deep_object : public gc_object
+    {
+    public:
+        deep_object()
+        {
+            ++instance_count;
+            if (++level_count < 100)
+            {
+                child1 = new_gc<deep_object>();
+                child2 = new_gc<deep_object>();
+                child3 = new_gc<deep_object>();
+            }
+        }
+
+        virtual ~deep_object()
+        {
+            --instance_count;
+        }
+
+        deep_object_ptr child1;
+        deep_object_ptr child2;
+        deep_object_ptr child3;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(child1);
+            gc->mark(child2);
+            gc->mark(child3);
+        }
+    };
+
+    deep_object_ptr _test_deep_call()
+    {
+        deep_object_ptr test = new_gc<deep_object>();
+        BOOST_CHECK_NE(instance_count, 0);
+        gc::get_gc().collect(true);
+        gc::get_gc().unmark(test); // simulate out of scope
+        return deep_object_ptr();
+    }
+
+    BOOST_AUTO_TEST_CASE(test_deep_call)
+    {
+        _test_deep_call();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace long_list_reference
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    void worker_func()
+    {
+        list_object_ptr head = new_gc<list_object>();
+        list_object_ptr node = head;
+        for (int32_t i = 1; i < 20000; ++i)
+        {
+            node->next = new_gc<list_object>();
+            node = node->next;
+        }
+        node.reset();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 20000);
+        gc::get_gc().unmark(head); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_long_list)
+    {
+        // marking a long list must not recurse once per object
+        boost::thread::attributes attributes;
+        attributes.set_stack_size(256 * 1024);
+        boost::thread worker_thread(attributes, worker_func);
+        worker_thread.join();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_parallel_mark
+{
+    int32_t instance_count = 0;
+
+    class tree_object;
+    typedef gc_ptr<tree_object> tree_object_ptr;
+
+    class tree_object : public gc_object
+    {
+    public:
+        tree_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~tree_object()
+        {
+            --instance_count;
+        }
+
+        tree_object_ptr left;
+        tree_object_ptr right;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(left);
+            gc->mark(right);
+        }
+    };
+
+    // distinct fake object addresses for exercising mark deques
+    const gc_object* deque_item(size_t i)
+    {
+        return (const gc_object*)(uintptr_t)((i + 1) * sizeof(void*));
+    }
+
+    void steal_func(detail::mark_deque* deque, boost::atomic<bool>* done, std::vector<int32_t>* seen)
+    {
+        const gc_object* pobj;
+        while (!done->load() || !deque->empty())
+        {
+            if (deque->steal(pobj))
+                ++(*seen)[(uintptr_t)pobj / sizeof(void*) - 1];
+        }
+    }
+
+    void _test_mark_deque()
+    {
+        detail::mark_deque deque;
+        const gc_object* pobj = NULL;
+        BOOST_CHECK(deque.empty());
+        BOOST_CHECK(!deque.take(pobj));
+        BOOST_CHECK(!deque.steal(pobj));
+
+        // owner takes newest first and thieves steal oldest first, across growth
+        for (size_t i = 0; i < 3000; ++i)
+            deque.push(deque_item(i));
+        BOOST_CHECK(deque.steal(pobj));
+        BOOST_CHECK_EQUAL(pobj, deque_item(0));
+        BOOST_CHECK(deque.take(pobj));
+        BOOST_CHECK_EQUAL(pobj, deque_item(2999));
+        while (deque.take(pobj))
+        {
+        }
+        BOOST_CHECK(deque.empty());
+        deque.reset();
+
+        // every object is removed exactly once while two thieves compete
+        const size_t count = 100000;
+        std::vector<int32_t> taken(count, 0);
+        std::vector<int32_t> stolen1(count, 0);
+        std::vector<int32_t> stolen2(count, 0);
+        boost::atomic<bool> done(false);
+        boost::thread thief1(steal_func, &deque, &done, &stolen1);
+        boost::thread thief2(steal_func, &deque, &done, &stolen2);
+        for (size_t i = 0; i < count; ++i)
+        {
+            deque.push(deque_item(i));
+            if (i % 3 == 0 && deque.take(pobj))
+                ++taken[(uintptr_t)pobj / sizeof(void*) - 1];
+        }
+        while (deque.take(pobj))
+            ++taken[(uintptr_t)pobj / sizeof(void*) - 1];
+        done = true;
+        thief1.join();
+        thief2.join();
+        deque.reset();
+
+        size_t removed_once = 0;
+        for (size_t i = 0; i < count; ++i)
+            removed_once += taken[i] + stolen1[i] + stolen2[i] == 1;
+        BOOST_CHECK_EQUAL(removed_once, count);
+    }
+
+    tree_object_ptr _test_tree(int32_t depth)
+    {
+        tree_object_ptr node = new_gc<tree_object>();
+        if (depth > 1)
+        {
+            node->left = _test_tree(depth - 1);
+            node->right = _test_tree(depth - 1);
+        }
+        return node;
+    }
+
+    void _test_parallel_mark()
+    {
+        gc::set_mark_threads(3);
+        const gc_stats& stats = gc::get_gc().stats();
+
+        // large enough to be split between the helpers
+        tree_object_ptr root = _test_tree(13);
+        BOOST_CHECK_EQUAL(instance_count, 8191);
+
+        // each object is traced by exactly one worker
+        uint64_t traced = stats.objects_traced;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 8191);
+        BOOST_CHECK_EQUAL(instance_count, 8191);
+
+        root->left.reset();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 4096);
+
+        gc::set_mark_threads(0);
+        gc::get_gc().unmark(root); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_parallel_mark)
+    {
+        _test_mark_deque();
+        _test_parallel_mark();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_incremental_mark
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+    typedef vector_ptr< std::vector<list_object_ptr> > list_vector;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+        list_object_ptr item;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+            gc->mark(item);
+        }
+    };
+
+    void _test_incremental_mark()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        list_object_ptr head;
+        for (int32_t i = 0; i < 2000; ++i)
+        {
+            list_object_ptr node = new_gc<list_object>();
+            node->next = head;
+            node->item = new_gc<list_object>();
+            head = node;
+        }
+        list_vector items = new_vector<list_vector::vector_type>();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 4000);
+
+        // a slice with no time budget stops after the first deadline check
+        uint64_t slices = stats.mark_slices;
+        BOOST_CHECK(gc::get_gc().collect_slice(0, true));
+
+        // an item moved into a container, and an object allocated while
+        // marking, survive the collection
+        uint64_t shaded = stats.objects_shaded;
+        items.push_back(head->item);
+        head->item = new_gc<list_object>();
+
+        // between slices, items of neighbouring nodes are swapped further down
+        // the list, so they move between traced and untraced nodes and are
+        // shaded by the insertion barrier
+        uint64_t stores = 1;
+        list_object* node = head->next.get();
+        while (gc::get_gc().collect_slice(0))
+        {
+            if (node == NULL || !node->next)
+                continue;
+            list_object_ptr item = node->item;
+            node->item = node->next->item;
+            node->next->item = item;
+            node = node->next->next.get();
+            stores += 2;
+        }
+        BOOST_CHECK_GE(stats.objects_shaded - shaded, stores);
+        BOOST_CHECK_GT(stats.mark_slices - slices, 1);
+        BOOST_CHECK_EQUAL(instance_count, 4001);
+
+        // later collections only find the moved item in the container
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 4001);
+        items.clear();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 4000);
+
+        // incremental collection from new_gc completes within a few calls
+        gc::get_gc().set_slice_budget(1000);
+        slices = stats.mark_slices;
+        for (int32_t i = 0; i < 1000; ++i)
+            gc::get_gc().unmark(new_gc<list_object>()); // simulate out of scope
+        gc::get_gc().set_slice_budget(0);
+        BOOST_CHECK_GT(stats.mark_slices, slices);
+
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().unmark(items); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_incremental_mark)
+    {
+        _test_incremental_mark();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_concurrent_mark
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+    typedef vector_ptr< std::vector<list_object_ptr> > list_vector;
+    typedef list_ptr< std::list<list_object_ptr> > list_list;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+        list_object_ptr item;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+            gc->mark(item);
+        }
+    };
+
+    void _test_concurrent_mark()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        list_object_ptr head;
+        for (int32_t i = 0; i < 2000; ++i)
+        {
+            list_object_ptr node = new_gc<list_object>();
+            node->next = head;
+            node->item = new_gc<list_object>();
+            head = node;
+        }
+        list_vector items = new_vector<list_vector::vector_type>();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 4000);
+
+        // while the background thread marks, every item is shifted one node
+        // down the list, so each overwritten item is only held by a local
+        // handle created after the mark began, and survives through the
+        // snapshot barrier however far marking has progressed
+        gc::collect_handle handle = gc::get_gc().collect_async();
+        list_object_ptr carry = head->item;
+        for (list_object* node = head->next.get(); node != NULL; node = node->next.get())
+        {
+            list_object_ptr item = node->item;
+            node->item = carry;
+            carry = item;
+        }
+        head->item = carry;
+        carry.reset();
+
+        // as does an item only held by a container
+        items.push_back(head->item);
+        head->item.reset();
+
+        // objects allocated while marking are registered once it finishes
+        head->item = new_gc<list_object>();
+        handle.wait();
+        BOOST_CHECK(handle.done());
+        uint64_t deferred = stats.objects_deferred;
+        gc::get_gc().collect();
+        BOOST_CHECK_LE(stats.objects_deferred - deferred, 1);
+        BOOST_CHECK_EQUAL(instance_count, 4001);
+
+        // a forced collection waits for a concurrent one, then collects fully
+        handle = gc::get_gc().collect_async();
+        items.pop_back();
+        gc::get_gc().collect(true);
+        BOOST_CHECK(handle.done());
+        BOOST_CHECK_EQUAL(instance_count, 4000);
+        BOOST_CHECK(gc::collect_handle().done());
+
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().unmark(items); // simulate out of scope
+    }
+
+    void _test_concurrent_containers()
+    {
+        // containers are changed at both ends while the background thread
+        // traces them, so list nodes are freed and vector storage is
+        // reallocated under it
+        list_list queue = new_list<list_list::list_type>();
+        list_vector items = new_vector<list_vector::vector_type>();
+        for (int32_t i = 0; i < 1000; ++i)
+            items.push_back(new_gc<list_object>());
+        for (int32_t i = 0; i < 100000; ++i)
+            queue.push_back(items[i % 1000]);
+        gc::get_gc().collect(true);
+        int32_t live = instance_count;
+
+        for (int32_t round = 0; round < 50; ++round)
+        {
+            gc::collect_handle handle = gc::get_gc().collect_async();
+            while (!handle.done())
+            {
+                list_object_ptr item = queue.back();
+                queue.pop_back();
+                queue.push_front(item);
+                item = queue.front();
+                queue.pop_front();
+                queue.push_back(item);
+                items.push_back(item);
+                if (items.size() > 100000)
+                    items.resize(1000);
+            }
+            BOOST_CHECK_EQUAL(instance_count, live);
+        }
+
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, live);
+        gc::get_gc().unmark(queue); // simulate out of scope
+        gc::get_gc().unmark(items); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_concurrent_mark)
+    {
+        _test_concurrent_mark();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        _test_concurrent_containers();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_generational
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+    typedef vector_ptr< std::vector<list_object_ptr> > list_vector;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+        list_object_ptr item;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+            gc->mark(item);
+        }
+    };
+
+    void _test_generational()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+        gc::get_gc().set_generational(true);
+
+        // a full collection promotes the list
+        list_object_ptr head;
+        for (int32_t i = 0; i < 2000; ++i)
+        {
+            list_object_ptr node = new_gc<list_object>();
+            node->next = head;
+            head = node;
+        }
+        list_vector items = new_vector<list_vector::vector_type>();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 2000);
+
+        // young objects stored in every 500th old node, one holding a young
+        // object itself, or in a container survive through the remembered set,
+        // while the old objects are only traced where a young one was stored
+        uint64_t remembered = stats.stores_remembered;
+        int32_t index = 0;
+        for (list_object* node = head.get(); node != NULL; node = node->next.get(), ++index)
+        {
+            if (index % 500 == 0)
+                node->item = new_gc<list_object>();
+        }
+        head->item->item = new_gc<list_object>();
+        items.push_back(new_gc<list_object>());
+        uint64_t minor = stats.minor_collections;
+        uint64_t traced = stats.objects_traced;
+        gc::get_gc().collect_nursery();
+        BOOST_CHECK_EQUAL(stats.minor_collections - minor, 1);
+        BOOST_CHECK_EQUAL(instance_count, 2006);
+        BOOST_CHECK_GE(stats.stores_remembered - remembered, 5);
+        BOOST_CHECK_LT(stats.objects_traced - traced, 100);
+
+        // a young object assigned to a container element in place is
+        // conservatively a root, while the promoted one it replaced is only
+        // freed by a full collection
+        items[0] = new_gc<list_object>();
+        gc::get_gc().collect_nursery();
+        BOOST_CHECK_EQUAL(instance_count, 2007);
+
+        // garbage is freed by minor collections from new_gc
+        uint64_t collections = stats.collections;
+        minor = stats.minor_collections;
+        for (int32_t i = 0; i < 1000; ++i)
+            gc::get_gc().unmark(new_gc<list_object>()); // simulate out of scope
+        gc::get_gc().collect_nursery();
+        gc::get_gc().finish_sweep();
+        BOOST_CHECK_EQUAL(stats.collections, collections);
+        BOOST_CHECK_GT(stats.minor_collections - minor, 4);
+        BOOST_CHECK_LT(instance_count, 2017);
+
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 2006);
+
+        gc::get_gc().set_generational(false);
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().unmark(items); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_generational)
+    {
+        _test_generational();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_lazy_sweep
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    void _test_lazy_sweep()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        list_object_ptr head = new_gc<list_object>();
+        list_object* node = head.get();
+        for (int32_t i = 1; i < 2000; ++i)
+        {
+            node->next = new_gc<list_object>();
+            node = node->next.get();
+        }
+        node = NULL;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 2000);
+
+        // the collection triggered by the 201st call to new_gc queues the
+        // list, which the calls that follow destroy a bounded share at a time
+        uint64_t destroyed = stats.objects_destroyed;
+        uint64_t steps = stats.sweep_steps;
+        gc::get_gc().unmark(head); // simulate out of scope
+        for (int32_t i = 0; i < 210; ++i)
+            gc::get_gc().unmark(new_gc<list_object>()); // simulate out of scope
+        BOOST_CHECK_GT(stats.sweep_steps - steps, 0);
+        BOOST_CHECK_LE(stats.objects_destroyed - destroyed, (stats.sweep_steps - steps) * 64);
+        BOOST_CHECK_GT(instance_count, 1000);
+
+        gc::get_gc().finish_sweep();
+        BOOST_CHECK_LT(instance_count, 20);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_lazy_sweep)
+    {
+        _test_lazy_sweep();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_finalizer_threads
+{
+    boost::atomic<int32_t> instance_count(0);
+    boost::thread::id destroyed_on;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            destroyed_on = boost::this_thread::get_id();
+            --instance_count;
+        }
+
+        list_object_ptr next;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    void _test_finalizer_threads()
+    {
+        // objects visit the static gc last, which hands them to the finalizer
+        const gc_stats& stats = gc::get_static_gc().stats();
+        gc::set_finalizer_threads(1);
+
+        list_object_ptr head = new_gc<list_object>();
+        list_object* node = head.get();
+        for (int32_t i = 1; i < 1000; ++i)
+        {
+            node->next = new_gc<list_object>();
+            node = node->next.get();
+        }
+        node = NULL;
+        gc::get_gc().collect(true);
+        gc::flush_finalizers();
+        BOOST_CHECK_EQUAL(instance_count.load(), 1000);
+
+        uint64_t finalized = stats.objects_finalized;
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().collect(true);
+        gc::flush_finalizers();
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+        BOOST_CHECK_EQUAL(stats.objects_finalized - finalized, 1000);
+        BOOST_CHECK(destroyed_on != boost::this_thread::get_id());
+
+        // objects handed over are destroyed before the finalizers stop
+        gc::get_gc().unmark(new_gc<list_object>()); // simulate out of scope
+        gc::get_gc().collect(true);
+        gc::set_finalizer_threads(0);
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_finalizer_threads)
+    {
+        _test_finalizer_threads();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+    }
+}
+
+namespace test_slab_allocator
+{
+    boost::atomic<int32_t> instance_count(0);
+
+    class slab_object : public gc_object
+    {
+    public:
+        slab_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~slab_object()
+        {
+            --instance_count;
+        }
+
+        char payload[200];
+    };
+
+    typedef gc_ptr<slab_object> slab_object_ptr;
+
+    // allocate unreferenced objects, recording their addresses inverted so
+    // they are not found as roots
+    void _test_slab_allocator(int32_t count, std::set<uintptr_t>& addresses)
+    {
+        for (int32_t i = 0; i < count; ++i)
+        {
+            slab_object_ptr obj = new_gc<slab_object>();
+            addresses.insert(~(uintptr_t)obj.get());
+            gc::get_gc().unmark(obj); // simulate out of scope
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(test_slab_allocator)
+    {
+        // the cell of a destroyed object is the next allocated in its slab
+        std::set<uintptr_t> freed;
+        std::set<uintptr_t> allocated;
+        _test_slab_allocator(1, freed);
+        gc::get_gc().collect(true);
+        gc::get_gc().finish_sweep();
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+        _test_slab_allocator(1, allocated);
+        BOOST_CHECK(allocated == freed);
+        gc::get_gc().collect(true);
+        gc::get_gc().finish_sweep();
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+
+        // cells freed by another thread are returned to the slabs of this
+        // thread, and reused once its other cells are exhausted
+        freed.clear();
+        allocated.clear();
+        gc::set_finalizer_threads(1);
+        _test_slab_allocator(1000, freed);
+        gc::get_gc().collect(true);
+        gc::set_finalizer_threads(0);
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+
+        _test_slab_allocator(2000, allocated);
+        int32_t reused = 0;
+        for (std::set<uintptr_t>::const_iterator address = allocated.begin(); address != allocated.end(); ++address)
+            reused += (int32_t)freed.count(*address);
+        BOOST_CHECK_GT(reused, 0);
+        gc::get_gc().collect(true);
+        gc::get_gc().finish_sweep();
+        BOOST_CHECK_EQUAL(instance_count.load(), 0);
+    }
+}
+
+namespace test_heap_release
+{
+    int32_t instance_count = 0;
+
+    class list_object;
+    typedef gc_ptr<list_object> list_object_ptr;
+
+    class list_object : public gc_object
+    {
+    public:
+        list_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~list_object()
+        {
+            --instance_count;
+        }
+
+        list_object_ptr next;
+        char payload[200];
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    void _test_heap_release()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        list_object_ptr head = new_gc<list_object>();
+        list_object* node = head.get();
+        for (int32_t i = 1; i < 20000; ++i)
+        {
+            node->next = new_gc<list_object>();
+            node = node->next.get();
+        }
+        node = NULL;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 20000);
+        BOOST_CHECK_GE(stats.heap_bytes_committed, 20000 * sizeof(list_object));
+        BOOST_CHECK_GE(stats.heap_bytes_reserved, stats.heap_bytes_committed + stats.heap_bytes_released);
+        uint64_t committed = stats.heap_bytes_committed;
+        uint64_t released = stats.heap_bytes_released;
+
+        // emptied chunks are kept through the next collection, in case they
+        // are needed again, and then released
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        BOOST_CHECK_LE(stats.heap_bytes_committed + 20000 * sizeof(list_object) / 2, committed);
+        uint64_t kept = stats.heap_bytes_released;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_GT(stats.heap_bytes_released, kept);
+        BOOST_CHECK_GE(stats.heap_bytes_released, released + 2 * 1024 * 1024);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_heap_release)
+    {
+        _test_heap_release();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_trivially_destructible
+{
+    int32_t instance_count = 0;
+
+    class trivial_object;
+    typedef gc_ptr<trivial_object> trivial_object_ptr;
+
+    // the destructor only counts objects, to show that it is not run
+    class trivial_object : public gc_object
+    {
+    public:
+        trivial_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~trivial_object()
+        {
+            --instance_count;
+        }
+
+        trivial_object_ptr next;
+        int32_t value;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    class other_object : public trivial_object
+    {
+    };
+}
+
+// traits are specialized in their own namespace, outside the test suite
+BOOST_AUTO_TEST_SUITE_END()
+
+namespace lutze
+{
+    template <>
+    struct gc_trivially_destructible<collection_test::test_trivially_destructible::trivial_object> : public boost::true_type
+    {
+    };
+}
+
+BOOST_FIXTURE_TEST_SUITE(collection_test, collection_fixture)
+
+namespace test_trivially_destructible
+{
+    void _test_trivially_destructible()
+    {
+        // objects visit the static gc last, which frees them
+        const gc_stats& stats = gc::get_static_gc().stats();
+
+        trivial_object_ptr head = new_gc<trivial_object>();
+        trivial_object* node = head.get();
+        for (int32_t i = 1; i < 1000; ++i)
+        {
+            node->next = new_gc<trivial_object>();
+            node = node->next.get();
+        }
+        node = NULL;
+
+        // derived classes are not trivially destructible unless specialized,
+        // so are allocated from different slabs
+        gc_ptr<other_object> other = new_gc<other_object>();
+        BOOST_CHECK_NE((uintptr_t)head.get() / detail::slab::size, (uintptr_t)other.get() / detail::slab::size);
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1001);
+
+        uint64_t reclaimed = stats.objects_reclaimed;
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().unmark(other); // simulate out of scope
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_reclaimed - reclaimed, 1000);
+        BOOST_CHECK_EQUAL(instance_count, 1000);
+        instance_count = 0;
+    }
+
+    BOOST_AUTO_TEST_CASE(test_trivially_destructible)
+    {
+        _test_trivially_destructible();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_leaf_objects
+{
+    typedef vector_ptr< std::vector< gc_ptr<gc_string> > > string_vector;
+
+    void _test_leaf_objects()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        string_vector strings = new_vector<string_vector::vector_type>();
+        for (int32_t i = 0; i < 1000; ++i)
+            strings.push_back(new_gc_string(std::string(i % 100, 'a' + i % 26)));
+        BOOST_CHECK_EQUAL(strings[0]->size(), 0);
+        BOOST_CHECK_EQUAL(strings[0]->c_str()[0], 0);
+        BOOST_CHECK_EQUAL(strings[999]->str(), std::string(99, 'a' + 999 % 26));
+        BOOST_CHECK_EQUAL(strings[999]->c_str()[99], 0);
+
+        const char bytes[] = { 1, 2, 3 };
+        gc_ptr<gc_blob> blob = new_gc_blob(sizeof(bytes), bytes);
+        gc_ptr<gc_blob> zeroed = new_gc_blob(64);
+        BOOST_CHECK_EQUAL(blob->size(), 3);
+        BOOST_CHECK_EQUAL((*blob)[2], 3);
+        BOOST_CHECK_EQUAL(std::count(zeroed->begin(), zeroed->end(), 0), 64);
+
+        // leaves are kept alive without being traced, so only the vector is
+        uint64_t traced = stats.objects_traced;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 1);
+        BOOST_CHECK_EQUAL(strings[500]->str(), std::string(0, 'a'));
+        BOOST_CHECK_EQUAL(strings[501]->str(), std::string(1, 'a' + 501 % 26));
+
+        // objects visit the static gc last, which frees them
+        const gc_stats& static_stats = gc::get_static_gc().stats();
+        uint64_t reclaimed = static_stats.objects_reclaimed;
+        gc::get_gc().unmark(strings); // simulate out of scope
+        gc::get_gc().unmark(blob); // simulate out of scope
+        gc::get_gc().unmark(zeroed); // simulate out of scope
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(static_stats.objects_reclaimed - reclaimed, 1002);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_leaf_objects)
+    {
+        _test_leaf_objects();
+        gc::get_gc().collect(true);
+    }
+}
+
+namespace test_gc_array
+{
+    int32_t instance_count = 0;
+
+    class array_node;
+    typedef gc_ptr<array_node> array_node_ptr;
+    typedef gc_ptr< gc_array<array_node> > array_node_array;
+
+    class array_node : public gc_object
+    {
+    public:
+        array_node(int32_t value = 0) : value(value)
+        {
+            ++instance_count;
+        }
+
+        virtual ~array_node()
+        {
+            --instance_count;
+        }
+
+        array_node_ptr next;
+        int32_t value;
+
+        virtual void mark_members(gc* gc) const
+        {
+            gc->mark(next);
+        }
+    };
+
+    array_node_array _test_array()
+    {
+        array_node_array nodes = new_gc_array<array_node>(1000, 7);
+        for (size_t i = 0; i < 999; ++i)
+            (*nodes)[i]->next = (*nodes)[i + 1];
+        (*nodes)[999]->next = new_gc<array_node>(8);
+        return nodes;
+    }
+
+    void _test_gc_array()
+    {
+        const gc_stats& stats = gc::get_gc().stats();
+
+        array_node_array nodes = _test_array();
+        BOOST_CHECK_EQUAL(nodes->size(), 1000);
+        BOOST_CHECK_EQUAL(instance_count, 1001);
+        BOOST_CHECK_EQUAL((*nodes)[1].get(), (*nodes)[0].get() + 1);
+        BOOST_CHECK_EQUAL(nodes->begin()[500].value, 7);
+
+        // elements are traced with the array rather than one by one
+        uint64_t traced = stats.objects_traced;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 2);
+        BOOST_CHECK_EQUAL(instance_count, 1001);
+
+        // a pointer to any element keeps the whole array alive
+        array_node_ptr middle = (*nodes)[500];
+        nodes.reset();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1001);
+        BOOST_CHECK_EQUAL(middle->next->value, 7);
+
+        // objects visit the static gc last, which destroys the array as one
+        const gc_stats& static_stats = gc::get_static_gc().stats();
+        uint64_t destroyed = static_stats.objects_destroyed;
+        gc::get_gc().unmark(middle); // simulate out of scope
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(static_stats.objects_destroyed - destroyed, 2);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+
+    BOOST_AUTO_TEST_CASE(test_gc_array)
+    {
+        _test_gc_array();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_no_scan_region
+{
+    int32_t instance_count = 0;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    #if !defined(GC_PRECISE_ROOTS)
+    void _test_excluded_buffer()
+    {
+        uintptr_t buffer[8192];
+        gc::get_gc().collect(true);
+        gc_stats before = gc::get_gc().stats();
+        {
+            gc::no_scan_region outer(buffer, sizeof(buffer));
+            gc::no_scan_region inner(buffer + 4096, sizeof(buffer) / 2);
+            gc::get_gc().collect(true);
+        }
+        gc_stats after = gc::get_gc().stats();
+        BOOST_CHECK_LE(after.last_scan_bytes + sizeof(buffer), before.last_scan_bytes + before.last_scan_bytes_skipped);
+    }
+
+    void _test_throw_region(uintptr_t* buffer, size_t size)
+    {
+        gc::no_scan_region outer(buffer, size);
+        gc::no_scan_region inner(buffer + 1, size - sizeof(uintptr_t));
+        throw std::runtime_error("unwind");
+    }
+
+    void _test_unwound_buffer()
+    {
+        uintptr_t buffer[1024] = { 0 }; // no stale addresses left behind
+        BOOST_CHECK_THROW(_test_throw_region(buffer, sizeof(buffer)), std::runtime_error);
+        test_object_ptr test = new_gc<test_object>();
+        buffer[100] = (uintptr_t)test.get();
+        test.reset();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1); // regions released during unwinding
+        buffer[100] = 0;
+    }
+    #endif
+
+    BOOST_AUTO_TEST_CASE(test_no_scan_region)
+    {
+        #if !defined(GC_PRECISE_ROOTS)
+        _test_excluded_buffer();
+        _test_unwound_buffer();
+        #endif
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_alternate_stack
+{
+    int32_t instance_count = 0;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    void _test_frame()
+    {
+        std::vector<uintptr_t> frame(64);
+        gc::get_gc().register_stack(&frame[0], frame.size() * sizeof(uintptr_t));
+        test_object_ptr test = new_gc<test_object>();
+        frame[10] = (uintptr_t)test.get();
+        test.reset(); // only registered frame refers to object
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+        gc::get_gc().unregister_stack(&frame[0]);
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+
+    #if defined(GC_PLATFORM_LINUX)
+    ucontext_t thread_context;
+    ucontext_t fiber_context;
+    std::vector<uint8_t> fiber_stack(65536);
+
+    void _test_fiber()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        gc::get_gc().switch_stack(NULL);
+        swapcontext(&fiber_context, &thread_context);
+
+        // resumed on fiber, with thread stack suspended
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 2);
+        test.reset();
+        gc::get_gc().switch_stack(NULL);
+    }
+
+    void _test_fiber_stack()
+    {
+        gc::get_gc().register_stack(&fiber_stack[0], fiber_stack.size());
+        getcontext(&fiber_context);
+        fiber_context.uc_stack.ss_sp = &fiber_stack[0];
+        fiber_context.uc_stack.ss_size = fiber_stack.size();
+        fiber_context.uc_link = &thread_context;
+        makecontext(&fiber_context, _test_fiber, 0);
+
+        gc::get_gc().switch_stack(&fiber_stack[0]);
+        swapcontext(&thread_context, &fiber_context);
+
+        // fiber suspended holding the only reference to its object
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+
+        test_object_ptr test = new_gc<test_object>();
+        gc::get_gc().switch_stack(&fiber_stack[0]);
+        swapcontext(&thread_context, &fiber_context);
+
+        gc::get_gc().unregister_stack(&fiber_stack[0]);
+        gc::get_gc().unmark(test); // simulate out of scope
+    }
+    #endif
+
+    BOOST_AUTO_TEST_CASE(test_alternate_stack)
+    {
+        _test_frame();
+        #if defined(GC_PLATFORM_LINUX)
+        _test_fiber_stack();
+        #endif
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_interior_pointer
+{
+    int32_t instance_count = 0;
+
+    struct unmanaged_base
+    {
+        char data[40];
+    };
+
+    // gc_object is not the first base, so is offset from the allocation
+    class offset_object : public unmanaged_base, public gc_object
+    {
+    public:
+        offset_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~offset_object()
+        {
+            --instance_count;
+        }
+
+        uint64_t values[16];
+    };
+
+    typedef gc_ptr<offset_object> offset_object_ptr;
+
+    offset_object_ptr _test_offset_base()
+    {
+        offset_object_ptr test = new_gc<offset_object>();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+        gc::get_gc().unmark(test); // simulate out of scope
+        return offset_object_ptr();
+    }
+
+    #if !defined(GC_PRECISE_ROOTS)
+    void _test_member_pointer()
+    {
+        offset_object_ptr test = new_gc<offset_object>();
+        uint64_t* value = &test->values[12];
+        test.reset(); // only interior pointer refers to object
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+        BOOST_CHECK(value != NULL);
+    }
+
+    void _test_unaligned_pointer()
+    {
+        offset_object_ptr test = new_gc<offset_object>();
+        const char* byte = (const char*)&test->values[12] + 3;
+        BOOST_CHECK((uintptr_t)byte % sizeof(void*) != 0);
+        test.reset(); // only unaligned interior pointer refers to object
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+        BOOST_CHECK(byte != NULL);
+    }
+    #endif
+
+    BOOST_AUTO_TEST_CASE(test_interior_pointer)
+    {
+        _test_offset_base();
+        #if !defined(GC_PRECISE_ROOTS)
+        _test_member_pointer();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        _test_unaligned_pointer();
+        #endif
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_precise_roots
+{
+    int32_t instance_count = 0;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    #if defined(GC_PRECISE_ROOTS)
+    void _test_raw_pointer()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        test_object* raw = test.get();
+        test.reset(); // raw pointers on the stack are not roots
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        BOOST_CHECK(raw != NULL);
+    }
+
+    void _test_copied_root()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        {
+            test_object_ptr copy(test);
+            test.reset(); // copy must be linked as a root
+            gc::get_gc().collect(true);
+            BOOST_CHECK_EQUAL(instance_count, 1);
+        }
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+    #endif
+
+    BOOST_AUTO_TEST_CASE(test_precise_roots)
+    {
+        #if defined(GC_PRECISE_ROOTS)
+        _test_raw_pointer();
+        _test_copied_root();
+        #endif
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+    }
+}
+
+namespace test_copy_object
+{
+    int32_t instance_count = 0;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            ++instance_count;
+        }
+
+        test_object(const test_object& rhs) : gc_object(rhs)
+        {
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    test_object_ptr _test_copy_object()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        test_object_ptr copy = new_gc<test_object>(*test); // copy is registered separately
+        BOOST_CHECK_EQUAL(instance_count, 2);
+        gc::get_gc().unmark(test); // simulate out of scope
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+        gc::get_gc().unmark(copy); // simulate out of scope
+        return test_object_ptr();
     }
 
-    BOOST_AUTO_TEST_CASE(test_non_gc_collect)
+    BOOST_AUTO_TEST_CASE(test_copy_object)
     {
-        _member_test_object();
+        _test_copy_object();
         gc::get_gc().collect(true);
         BOOST_CHECK_EQUAL(instance_count, 0);
-        BOOST_CHECK_EQUAL(managed_count, 0);
-        BOOST_CHECK_EQUAL(unmanaged_count, 0);
     }
 }
 
-namespace cyclic_reference
+namespace test_allocation_free
 {
     int32_t instance_count = 0;
 
-    class cycle_object;
-    typedef gc_ptr<cycle_object> cycle_object_ptr;
-
-    class cycle_object : public gc_object
+    class test_object : public gc_object
     {
     public:
-        cycle_object()
+        test_object()
         {
             ++instance_count;
         }
 
-        virtual ~cycle_object()
+        virtual ~test_object()
         {
             --instance_count;
         }
+    };
 
-        virtual void mark_members(gc* gc) const
-        {
-            gc->mark(other);
-        }
+    typedef gc_ptr<test_object> test_object_ptr;
 
-        void set_other(cycle_object_ptr other)
+    void _test_garbage()
+    {
+        for (int32_t i = 0; i < 100; ++i)
+            gc::get_gc().unmark(new_gc<test_object>()); // simulate out of scope
+    }
+
+    void _test_allocation_free()
+    {
+        test_object_ptr test = new_gc<test_object>();
+
+        // the first cycles size the scratch buffers
+        for (int32_t i = 0; i < 3; ++i)
         {
-            this->other = other;
+            _test_garbage();
+            gc::get_gc().collect(true);
         }
 
-        cycle_object_ptr other;
-    };
+        _test_garbage();
+        allocation_count = 0;
+        count_allocations = true;
+        gc::get_gc().collect(true);
+        count_allocations = false;
+        BOOST_CHECK_EQUAL(allocation_count, 0);
+        BOOST_CHECK_GE(instance_count, 1);
+        gc::get_gc().unmark(test); // simulate out of scope
+    }
 
-    cycle_object_ptr _test_cyclic_references()
+    void _test_finalizer_allocation_free()
     {
-        cycle_object_ptr test1 = new_gc<cycle_object>();
-        cycle_object_ptr test2 = new_gc<cycle_object>();
-        test1->set_other(test2);
-        test2->set_other(test1);
-        BOOST_CHECK_NE(instance_count, 0);
+        // batches handed to the finalizer threads are recycled, so the
+        // collector keeps the capacity of its destroy list
+        gc::set_finalizer_threads(1);
+        for (int32_t i = 0; i < 3; ++i)
+        {
+            _test_garbage();
+            gc::get_gc().collect(true);
+            gc::flush_finalizers();
+        }
+
+        _test_garbage();
+        allocation_count = 0;
+        count_allocations = true;
         gc::get_gc().collect(true);
-        gc::get_gc().unmark(test1); // simulate out of scope
-        gc::get_gc().unmark(test2); // simulate out of scope
-        return cycle_object_ptr();
+        gc::flush_finalizers();
+        count_allocations = false;
+        BOOST_CHECK_EQUAL(allocation_count, 0);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        gc::set_finalizer_threads(0);
     }
 
-    BOOST_AUTO_TEST_CASE(test_cyclic_references)
+    BOOST_AUTO_TEST_CASE(test_allocation_free)
     {
-        _test_cyclic_references();
+        _test_allocation_free();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        _test_finalizer_allocation_free();
         gc::get_gc().collect(true);
         BOOST_CHECK_EQUAL(instance_count, 0);
     }
 }
 
-namespace recursive_stack
+namespace test_page_tracker
 {
     int32_t instance_count = 0;
 
-    class fib_object : public gc_object
+    class test_object;
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    class test_object : public gc_object
     {
     public:
-        fib_object()
+        test_object()
         {
             ++instance_count;
         }
 
-        virtual ~fib_object()
+        virtual ~test_object()
         {
             --instance_count;
         }
 
-        int32_t fibonacci(int32_t n)
+        virtual void mark_members(gc* gc) const
         {
-            if (n < 2)
-                return n;
-            return new_gc<fib_object>()->fibonacci(n - 1) + new_gc<fib_object>()->fibonacci(n - 2);
+            gc->mark(next);
+            gc->mark(child);
         }
-    };
 
-    typedef gc_ptr<fib_object> fib_object_ptr;
+        virtual bool inline_members() const
+        {
+            return true;
+        }
 
-    fib_object_ptr _test_recursive()
-    {
-        fib_object_ptr test = new_gc<fib_object>();
-        BOOST_CHECK_EQUAL(test->fibonacci(20), 6765);
-        BOOST_CHECK_NE(instance_count, 0);
-        gc::get_gc().collect(true);
-        gc::get_gc().unmark(test); // simulate out of scope
-        return fib_object_ptr();
-    }
+        test_object_ptr next;
+        test_object_ptr child;
+    };
 
-    BOOST_AUTO_TEST_CASE(test_recursive)
+    // reports only the objects a test has explicitly written
+    class test_tracker : public page_tracker
     {
-        _test_recursive();
-        gc::get_gc().collect(true);
-        BOOST_CHECK_EQUAL(instance_count, 0);
-    }
-}
-
-namespace deep_call_graph_reference
-{
-    int32_t instance_count = 0;
-    int32_t level_count = 0;
+    public:
+        test_tracker() : valid(true)
+        {
+        }
 
-    class deep_object;
-    typedef gc_ptr<deep_object> deep_object_ptr;
+        virtual bool begin()
+        {
+            return valid;
+        }
 
-    class deep_object : public gc_object
-    {
-    public:
-        deep_object()
+        virtual bool written(const void* ptr, size_t size)
         {
-            ++instance_count;
-            if (++level_count < 100)
+            for (std::vector<const void*>::const_iterator write = writes.begin(); write != writes.end(); ++write)
             {
-                child1 = new_gc<deep_object>();
-                child2 = new_gc<deep_object>();
-                child3 = new_gc<deep_object>();
+                if ((const uint8_t*)*write >= (const uint8_t*)ptr && (const uint8_t*)*write < (const uint8_t*)ptr + size)
+                    return true;
             }
+            return false;
         }
 
-        virtual ~deep_object()
+        virtual bool reset()
         {
-            --instance_count;
+            writes.clear();
+            valid = true;
+            return true;
         }
 
-        deep_object_ptr child1;
-        deep_object_ptr child2;
-        deep_object_ptr child3;
+        bool valid;
+        std::vector<const void*> writes;
+    };
 
-        virtual void mark_members(gc* gc) const
+    test_object_ptr _test_chain()
+    {
+        test_object_ptr head = new_gc<test_object>();
+        test_object_ptr node = head;
+        for (int32_t i = 1; i < 8; ++i)
         {
-            gc->mark(child1);
-            gc->mark(child2);
-            gc->mark(child3);
+            node->next = new_gc<test_object>();
+            node = node->next;
         }
-    };
+        return head;
+    }
 
-    deep_object_ptr _test_deep_call()
+    void _test_garbage()
     {
-        deep_object_ptr test = new_gc<deep_object>();
-        BOOST_CHECK_NE(instance_count, 0);
+        gc::get_gc().unmark(new_gc<test_object>()); // simulate out of scope
+    }
+
+    void _test_truncate(test_tracker& tracker, const test_object_ptr& node)
+    {
+        node->next.reset();
+        tracker.writes.push_back(node.get());
+    }
+
+    void _test_partial_trace()
+    {
+        test_tracker tracker;
+        gc::get_gc().set_page_tracker(&tracker);
+        const gc_stats& stats = gc::get_gc().stats();
+
+        test_object_ptr head = _test_chain();
+        test_object_ptr second = head->next;
+        test_object_ptr fourth = second->next->next;
+
+        // first collection traces every object
+        uint64_t traced = stats.objects_traced;
         gc::get_gc().collect(true);
-        gc::get_gc().unmark(test); // simulate out of scope
-        return deep_object_ptr();
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 8);
+        BOOST_CHECK_EQUAL(instance_count, 8);
+
+        // nothing written, so nothing is retraced
+        traced = stats.objects_traced;
+        uint64_t unchanged = stats.objects_unchanged;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 0);
+        BOOST_CHECK_EQUAL(stats.objects_unchanged - unchanged, 8);
+        BOOST_CHECK_EQUAL(instance_count, 8);
+
+        // only written objects and new objects reachable from them are traced
+        second->child = new_gc<test_object>();
+        tracker.writes.push_back(second.get());
+        fourth->child = new_gc<test_object>();
+        tracker.writes.push_back(fourth.get());
+        traced = stats.objects_traced;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(stats.objects_traced - traced, 4);
+        BOOST_CHECK_EQUAL(instance_count, 10);
+        BOOST_CHECK(second->child);
+        BOOST_CHECK(fourth->child);
+
+        // new garbage is released by a partial trace
+        _test_garbage();
+        BOOST_CHECK_EQUAL(instance_count, 11);
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 10);
+
+        // garbage among unchanged objects needs a full trace
+        _test_truncate(tracker, fourth);
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 10);
+        tracker.valid = false;
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 6);
+
+        gc::get_gc().set_page_tracker(NULL);
+        gc::get_gc().unmark(head); // simulate out of scope
+        gc::get_gc().unmark(second); // simulate out of scope
+        gc::get_gc().unmark(fourth); // simulate out of scope
     }
 
-    BOOST_AUTO_TEST_CASE(test_deep_call)
+    void _test_soft_dirty()
     {
-        _test_deep_call();
+        soft_dirty_tracker tracker;
+        gc::get_gc().set_page_tracker(&tracker);
+
+        test_object_ptr head = _test_chain();
+        gc::get_gc().collect(true);
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 8);
+
+        // a real write is seen without being reported
+        head->child = new_gc<test_object>();
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 9);
+        BOOST_CHECK(head->child);
+
+        gc::get_gc().set_page_tracker(NULL);
+        gc::get_gc().unmark(head); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_page_tracker)
+    {
+        _test_partial_trace();
         gc::get_gc().collect(true);
         BOOST_CHECK_EQUAL(instance_count, 0);
+
+        // soft-dirty bits are not maintained by every kernel
+        if (soft_dirty_tracker::supported())
+        {
+            _test_soft_dirty();
+            gc::get_gc().collect(true);
+            BOOST_CHECK_EQUAL(instance_count, 0);
+        }
     }
 }
 
@@ -1482,4 +3331,136 @@ namespace test_thread_object_transfer
     }
 }
 
+namespace test_thread_id_reuse
+{
+    boost::mutex instance_mutex;
+    int32_t instance_count = 0;
+    volatile int32_t stage = 0;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            boost::mutex::scoped_lock lock(instance_mutex);
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            boost::mutex::scoped_lock lock(instance_mutex);
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    // raw pointer outside of scanned memory, so only thread b holds the object
+    test_object* shared = NULL;
+
+    void release_func()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        shared = test.get();
+        gc::get_gc().unmark(test); // simulate out of scope
+    }
+
+    void reuse_func()
+    {
+        // registers with the id freed by the released thread, the lowest one
+        gc::get_gc();
+        test_object_ptr test = shared;
+        stage = 1;
+        while (stage != 2)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        gc::get_gc().collect(true);
+        gc::get_gc().unmark(test); // simulate out of scope
+    }
+
+    BOOST_AUTO_TEST_CASE(test_thread_id_reuse)
+    {
+        gc::get_gc().collect(true); // static gc takes its id first
+        boost::thread release_thread(release_func);
+        release_thread.join();
+
+        boost::thread reuse_thread(reuse_func);
+        while (stage != 1)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+
+        // the history left by the released thread must not hide its successor
+        gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 1);
+
+        stage = 2;
+        reuse_thread.join();
+        for (int32_t i = 0; i < 10 && instance_count != 0; ++i)
+            gc::get_gc().collect(true);
+        BOOST_CHECK_EQUAL(instance_count, 0);
+        shared = NULL;
+    }
+}
+
+namespace test_thread_many_transfer
+{
+    boost::mutex instance_mutex;
+    int32_t instance_count = 0;
+    volatile bool stop = false;
+
+    class test_object : public gc_object
+    {
+    public:
+        test_object()
+        {
+            boost::mutex::scoped_lock lock(instance_mutex);
+            ++instance_count;
+        }
+
+        virtual ~test_object()
+        {
+            boost::mutex::scoped_lock lock(instance_mutex);
+            --instance_count;
+        }
+    };
+
+    typedef gc_ptr<test_object> test_object_ptr;
+
+    void worker_func()
+    {
+        while (!stop)
+        {
+            gc::get_gc().collect(true);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+    }
+
+    test_object_ptr _test_many_transfer()
+    {
+        test_object_ptr test = new_gc<test_object>();
+        gc::get_gc().unmark(test); // simulate out of scope
+        gc::get_gc().collect(true);
+        return test_object_ptr();
+    }
+
+    BOOST_AUTO_TEST_CASE(test_thread_many_transfer)
+    {
+        // more gc instances than fit in a single history word
+        std::vector<boost::thread*> threads;
+        for (int32_t i = 0; i < 80; ++i)
+            threads.push_back(new boost::thread(worker_func));
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+
+        _test_many_transfer();
+        for (int32_t i = 0; i < 500 && instance_count != 0; ++i)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        BOOST_CHECK_EQUAL(instance_count, 0); // released object visits every gc once
+
+        stop = true;
+        for (int32_t i = 0; i < 80; ++i)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()